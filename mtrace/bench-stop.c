@@ -0,0 +1,127 @@
+/*
+ * Measure what a syscall stop costs the tracer with each way mtrace can
+ * read it: no read at all, PTRACE_GETREGS and PTRACE_GET_SYSCALL_INFO.
+ *
+ * The tracee calls getppid() in a loop; every entry and exit stop is taken
+ * and read with the path under test.
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_ITERATIONS 200000
+
+enum fetch_path {
+	FETCH_NONE,
+	FETCH_GETREGS,
+	FETCH_SYSCALL_INFO,
+};
+
+static const char *const path_names[] = {
+	[FETCH_NONE] = "none",
+	[FETCH_GETREGS] = "getregs",
+	[FETCH_SYSCALL_INFO] = "syscall_info",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int fetch(enum fetch_path path, pid_t pid)
+{
+	struct user_regs_struct regs;
+	struct __ptrace_syscall_info info;
+
+	switch (path) {
+	case FETCH_GETREGS:
+		return ptrace(PTRACE_GETREGS, pid, 0, &regs) == -1 ? -1 : 0;
+	case FETCH_SYSCALL_INFO:
+		return ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) == -1 ? -1 : 0;
+	default:
+		return 0;
+	}
+}
+
+static void run(enum fetch_path path, long iterations)
+{
+	pid_t cpid = fork();
+	if (cpid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cpid == 0) {
+		// Child
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		raise(SIGSTOP);
+		for (long i = 0; i < iterations; i++)
+			syscall(SYS_getppid);
+		_exit(0);
+	}
+
+	// Sync with the child's SIGSTOP
+	waitpid(cpid, 0, 0);
+	ptrace(PTRACE_SETOPTIONS, cpid, 0, PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
+
+	uint64_t stops = 0, fetch_ns = 0;
+	uint64_t start = now_ns();
+	for (;;) {
+		int status;
+		if (ptrace(PTRACE_SYSCALL, cpid, 0, 0) == -1) {
+			perror("ptrace syscall");
+			exit(EXIT_FAILURE);
+		}
+		if (waitpid(cpid, &status, 0) == -1) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+
+		uint64_t t0 = now_ns();
+		if (fetch(path, cpid) == -1) {
+			if (errno == EIO) {
+				printf("%-14s unsupported by this kernel\n", path_names[path]);
+				kill(cpid, SIGKILL);
+				waitpid(cpid, 0, 0);
+				return;
+			}
+			perror("ptrace fetch");
+			exit(EXIT_FAILURE);
+		}
+		fetch_ns += now_ns() - t0;
+		stops++;
+	}
+	uint64_t total = now_ns() - start;
+
+	printf("%-14s %10llu %12.1f %14.1f\n", path_names[path],
+		   (unsigned long long) stops,
+		   (double) total / stops, (double) fetch_ns / stops);
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	if (iterations <= 0) {
+		printf("bench-stop [iterations]\n");
+		exit(1);
+	}
+
+	printf("%-14s %10s %12s %14s\n", "path", "stops", "ns/stop", "fetch ns/stop");
+	run(FETCH_NONE, iterations);
+	run(FETCH_GETREGS, iterations);
+	run(FETCH_SYSCALL_INFO, iterations);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: every power
+ * of two is split into HIST_SUB equal sub-buckets, so any recorded value
+ * is known to within 1/HIST_SUB (about 6%) and recording is a few
+ * instructions with no search.
+ */
+
+#ifndef MTRACE_HIST_H
+#define MTRACE_HIST_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned hist_bucket(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+
+	unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Highest value that falls into bucket b */
+static inline uint64_t hist_bucket_max(unsigned b)
+{
+	if (b < HIST_SUB)
+		return b;
+
+	unsigned shift = b / HIST_SUB - 1;
+	uint64_t low = (uint64_t) (HIST_SUB + b % HIST_SUB) << shift;
+	return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	h->buckets[hist_bucket(v)]++;
+	h->count++;
+}
+
+/* Smallest bucket bound that at least a fraction q of the values are below */
+static inline uint64_t hist_percentile(const struct hist *h, double q)
+{
+	if (h->count == 0)
+		return 0;
+
+	uint64_t target = (uint64_t) (q * h->count);
+	if (target < q * h->count || target == 0)
+		target++;
+
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= target)
+			return hist_bucket_max(b);
+	}
+	return hist_bucket_max(HIST_BUCKETS - 1);
+}
+
+#endif
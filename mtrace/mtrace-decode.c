@@ -0,0 +1,105 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "record.h"
+
+void usage() {
+	printf(
+		"mtrace-decode [-t] <ring file>\n"
+		);
+}
+
+int main(int argc, char *argv[])
+{
+	bool stamps = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			stamps = true;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		exit(1);
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+	if ((size_t) st.st_size < MTRACE_RING_DATA_OFFSET) {
+		fprintf(stderr, "%s: too short for a ring file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	const struct mtrace_ring_header *hdr = map;
+	if (hdr->magic != MTRACE_RING_MAGIC || hdr->version != MTRACE_RING_VERSION) {
+		fprintf(stderr, "%s: not an mtrace ring file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if (hdr->record_size != sizeof(struct mtrace_record) ||
+		hdr->capacity == 0 ||
+		MTRACE_RING_DATA_OFFSET + hdr->capacity * sizeof(struct mtrace_record) >
+		(uint64_t) st.st_size) {
+		fprintf(stderr, "%s: corrupt ring header\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	const struct mtrace_record *recs = (const struct mtrace_record *)
+		((const char *) map + MTRACE_RING_DATA_OFFSET);
+	uint64_t head = hdr->head;
+	/* Records past flushed may never have reached the file, e.g. when the
+	 * tracer died between two flushes: their slots hold zeroes or the
+	 * records of the previous lap */
+	if (hdr->flushed < head) {
+		fprintf(stderr, "%llu records not flushed, skipped\n",
+				(unsigned long long) (head - hdr->flushed));
+		head = hdr->flushed;
+	}
+	uint64_t first = 0;
+	if (head > hdr->capacity) {
+		first = head - hdr->capacity;
+		fprintf(stderr, "%llu records overwritten by ring wraparound\n",
+				(unsigned long long) first);
+	}
+
+	for (uint64_t n = first; n < head; n++) {
+		const struct mtrace_record *rec = &recs[n % hdr->capacity];
+		if (stamps)
+			printf("[%u] %llu.%09llu ", rec->tid,
+				   (unsigned long long) (rec->ts / 1000000000ULL),
+				   (unsigned long long) (rec->ts % 1000000000ULL));
+		mtrace_print_entry(stdout, rec);
+		mtrace_print_exit(stdout, rec);
+	}
+
+	munmap(map, st.st_size);
+	return 0;
+}
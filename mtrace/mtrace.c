@@ -1,30 +1,1649 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/user.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <signal.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "hist.h"
+#include "record.h"
+#include "syscallent.h"
+
+#define RING_DEFAULT_RECORDS (1 << 18)
+#define RING_FLUSH_INTERVAL_MS 100
+
+#define DECODE_DEFAULT_MAX 32
+#define DECODE_MAX 4096
+#define DECODE_SCRATCH_SIZE (6 * DECODE_MAX)
+
+/* -k: frames kept per sample, and how much stack is read to walk them */
+#define STACK_MAX_DEPTH 64
+#define STACK_WINDOW (64 * 1024)
+#define STACK_KEY_MAX (STACK_MAX_DEPTH * 128)
+#define FOLDED_BUCKETS 4096
+
+#define VM_READ_MAX (STACK_WINDOW > DECODE_MAX ? STACK_WINDOW : DECODE_MAX)
+
+/* Syscalls selected with -e trace=...; empty means trace everything */
+static bool traced[NR_SYSCALLS];
+static int ntraced;
+
+/* Binary output selected with -o; NULL means text on stderr */
+struct ring {
+	struct mtrace_ring_header *hdr;
+	struct mtrace_record *recs;
+	size_t maplen;
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+};
+
+static struct ring *ring;
+
+/*
+ * Per-syscall totals kept by -c in place of printing each call. The
+ * histograms are allocated on the first call of each syscall.
+ */
+struct syscall_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+	struct hist *latency;
+};
+
+static struct syscall_stats *summary;
+
+/*
+ * Read stops with PTRACE_GET_SYSCALL_INFO. Cleared by -R, which reads the
+ * full register set so that rbp is printed, and on kernels older than 5.3.
+ */
+static bool use_syscall_info = true;
+
+/* Folded stacks selected with -k, written out at exit */
+static FILE *stacks_out;
+
 void usage() {
 	printf(
-		"mtrace <program>"
+		"mtrace [-c] [-e trace=SYSCALL[,SYSCALL...]] [-o FILE [-b RECORDS]] [-R] [-s SIZE]\n"
+		"       [-k FILE] [--duty ON/PERIOD] <program> [args...] | -p PID\n"
 		);
 }
 
-int main(int argc, char *argv[])
+static int syscall_lookup(const char *name)
 {
-	if (argc < 2) {
-		usage();
-		exit(1);
+	char *end;
+	long nr = strtol(name, &end, 0);
+	if (*name != '\0' && *end == '\0')
+		return (nr >= 0 && nr < (long) NR_SYSCALLS) ? (int) nr : -1;
+
+	for (size_t i = 0; i < NR_SYSCALLS; i++) {
+		if (syscallent[i] && strcmp(syscallent[i], name) == 0)
+			return (int) i;
+	}
+	return -1;
+}
+
+static int parse_trace_expr(const char *expr)
+{
+	const char *prefix = "trace=";
+	if (strncmp(expr, prefix, strlen(prefix)) != 0) {
+		fprintf(stderr, "invalid expression: %s\n", expr);
+		return -1;
+	}
+
+	char *list = strdup(expr + strlen(prefix));
+	if (list == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	char *saveptr;
+	for (char *name = strtok_r(list, ",", &saveptr); name;
+		 name = strtok_r(NULL, ",", &saveptr)) {
+		int nr = syscall_lookup(name);
+		if (nr == -1) {
+			fprintf(stderr, "unknown syscall: %s\n", name);
+			free(list);
+			return -1;
+		}
+		if (!traced[nr]) {
+			traced[nr] = true;
+			ntraced++;
+		}
+	}
+	free(list);
+	return 0;
+}
+
+/*
+ * Build a filter that returns SECCOMP_RET_TRACE for the selected syscalls
+ * and SECCOMP_RET_ALLOW for everything else, so that only the selected
+ * syscalls ever stop the tracee.
+ */
+static int install_filter(void)
+{
+	struct sock_filter filter[2 * NR_SYSCALLS + 5];
+	unsigned short len = 0;
+
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+	filter[len++] = (struct sock_filter)
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0);
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+
+	for (size_t nr = 0; nr < NR_SYSCALLS; nr++) {
+		if (!traced[nr])
+			continue;
+		filter[len++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nr, 0, 1);
+		filter[len++] = (struct sock_filter)
+			BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+	}
+	filter[len++] = (struct sock_filter)
+		BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+	struct sock_fprog prog = {
+		.len = len,
+		.filter = filter,
+	};
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+		perror("prctl(PR_SET_NO_NEW_PRIVS)");
+		return -1;
+	}
+	if (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &prog) == -1) {
+		perror("seccomp");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sync the slots of records [from, to) and then the header page */
+static void ring_sync(struct ring *r, uint64_t from, uint64_t to)
+{
+	uint64_t cap = r->hdr->capacity;
+	long pagesz = sysconf(_SC_PAGESIZE);
+
+	if (to - from >= cap) {
+		from = 0;
+		to = cap;
+	} else {
+		from %= cap;
+		to %= cap;
+	}
+
+	/* A wrapped range is synced as two pieces */
+	uint64_t ranges[2][2] = { { from, to }, { 0, 0 } };
+	if (to < from) {
+		ranges[0][1] = cap;
+		ranges[1][1] = to;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (ranges[i][0] == ranges[i][1])
+			continue;
+		uintptr_t start = (uintptr_t) &r->recs[ranges[i][0]];
+		uintptr_t end = (uintptr_t) &r->recs[ranges[i][1]];
+		start &= ~(uintptr_t) (pagesz - 1);
+		if (msync((void *) start, end - start, MS_SYNC) == -1)
+			perror("msync");
+	}
+}
+
+/*
+ * Flusher thread. The tracer only ever stores into the mapping, and this
+ * thread pushes the written range to the file and publishes how far the
+ * file is known to be consistent.
+ */
+static void *ring_flush(void *arg)
+{
+	struct ring *r = arg;
+	bool done = false;
+
+	while (!done) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += RING_FLUSH_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		pthread_mutex_lock(&r->lock);
+		if (!r->done)
+			pthread_cond_timedwait(&r->cond, &r->lock, &deadline);
+		done = r->done;
+		pthread_mutex_unlock(&r->lock);
+
+		uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+		uint64_t flushed = r->hdr->flushed;
+		if (head == flushed)
+			continue;
+
+		ring_sync(r, flushed, head);
+		__atomic_store_n(&r->hdr->flushed, head, __ATOMIC_RELEASE);
+		if (msync(r->hdr, MTRACE_RING_DATA_OFFSET, MS_SYNC) == -1)
+			perror("msync");
+	}
+	return NULL;
+}
+
+static struct ring *ring_open(const char *path, uint64_t capacity)
+{
+	struct ring *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		free(r);
+		return NULL;
+	}
+
+	r->maplen = MTRACE_RING_DATA_OFFSET + capacity * sizeof(struct mtrace_record);
+	if (ftruncate(fd, r->maplen) == -1) {
+		perror("ftruncate");
+		close(fd);
+		free(r);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		free(r);
+		return NULL;
+	}
+
+	r->hdr = map;
+	r->recs = (struct mtrace_record *) ((char *) map + MTRACE_RING_DATA_OFFSET);
+	r->hdr->magic = MTRACE_RING_MAGIC;
+	r->hdr->version = MTRACE_RING_VERSION;
+	r->hdr->record_size = sizeof(struct mtrace_record);
+	r->hdr->capacity = capacity;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	errno = pthread_create(&r->flusher, NULL, ring_flush, r);
+	if (errno != 0) {
+		perror("pthread_create");
+		munmap(map, r->maplen);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+static void ring_append(struct ring *r, const struct mtrace_record *rec)
+{
+	uint64_t head = r->hdr->head;
+	r->recs[head % r->hdr->capacity] = *rec;
+	__atomic_store_n(&r->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Registered with atexit(), since the tracer exits along with the tracee */
+static void ring_close(void)
+{
+	if (ring == NULL)
+		return;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->done = true;
+	pthread_cond_signal(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->flusher, NULL);
+
+	munmap(ring->hdr, ring->maplen);
+	free(ring);
+	ring = NULL;
+}
+
+/*
+ * What a syscall or seccomp stop reports, read through either
+ * PTRACE_GET_SYSCALL_INFO or PTRACE_GETREGS.
+ */
+struct syscall_stop {
+	// PTRACE_SYSCALL_INFO_*, or _NONE when the fetch path can't tell
+	int op;
+	uint64_t nr;
+	uint64_t args[6];
+	int64_t ret;
+	uint64_t rip;
+	uint64_t rsp;
+	uint64_t rbp;
+	bool have_rbp;
+};
+
+static void fill_entry(struct mtrace_record *rec, pid_t tid,
+					   const struct syscall_stop *stop)
+{
+	rec->tid = tid;
+	rec->nr = stop->nr;
+	rec->ts = now_ns();
+	memcpy(rec->args, stop->args, sizeof(rec->args));
+	rec->ret = 0;
+	rec->rip = stop->rip;
+	rec->rbp = stop->rbp;
+	rec->flags = stop->have_rbp ? 0 : MTRACE_REC_NORBP;
+}
+
+static void fill_exit(struct mtrace_record *rec, const struct syscall_stop *stop)
+{
+	rec->ret = stop->ret;
+	rec->rip = stop->rip;
+}
+
+static size_t ntracees;
+
+static void summary_account(const struct mtrace_record *rec)
+{
+	if (rec->nr >= NR_SYSCALLS)
+		return;
+
+	struct syscall_stats *st = &summary[rec->nr];
+	st->calls++;
+	if (rec->flags & MTRACE_REC_NORET)
+		return;
+
+	if (rec->ret < 0 && rec->ret >= -4095)
+		st->errors++;
+	if (st->latency == NULL) {
+		st->latency = calloc(1, sizeof(*st->latency));
+		if (st->latency == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
 	}
+	uint64_t ns = now_ns() - rec->ts;
+	st->total_ns += ns;
+	hist_record(st->latency, ns);
+}
+
+static int summary_cmp(const void *a, const void *b)
+{
+	const struct syscall_stats *x = &summary[*(const int *) a];
+	const struct syscall_stats *y = &summary[*(const int *) b];
+	if (x->total_ns != y->total_ns)
+		return x->total_ns < y->total_ns ? 1 : -1;
+	return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+/* Registered with atexit(), like ring_close() */
+static void summary_print(void)
+{
+	int order[NR_SYSCALLS];
+	int n = 0;
+	for (size_t nr = 0; nr < NR_SYSCALLS; nr++) {
+		if (summary[nr].calls > 0)
+			order[n++] = nr;
+	}
+	qsort(order, n, sizeof(order[0]), summary_cmp);
+
+	fprintf(stderr, "%-20s %10s %8s %14s %10s %10s %10s\n",
+			"syscall", "calls", "errors", "total(us)", "p50(us)", "p99(us)", "p999(us)");
+	for (int i = 0; i < n; i++) {
+		const struct syscall_stats *st = &summary[order[i]];
+		const char *name = syscallent[order[i]] ? syscallent[order[i]] : "?";
+		if (st->latency == NULL) {
+			fprintf(stderr, "%-20s %10llu %8llu %14s %10s %10s %10s\n", name,
+					(unsigned long long) st->calls, (unsigned long long) st->errors,
+					"-", "-", "-", "-");
+			continue;
+		}
+		fprintf(stderr, "%-20s %10llu %8llu %14.3f %10.3f %10.3f %10.3f\n", name,
+				(unsigned long long) st->calls, (unsigned long long) st->errors,
+				st->total_ns / 1e3,
+				hist_percentile(st->latency, 0.50) / 1e3,
+				hist_percentile(st->latency, 0.99) / 1e3,
+				hist_percentile(st->latency, 0.999) / 1e3);
+	}
+}
+
+/*
+ * Argument decoding for the text output. Tracee memory is fetched with
+ * process_vm_readv into a scratch arena that is reset at every stop, so
+ * decoding never allocates.
+ */
+enum arg_kind {
+	ARG_NONE,
+	ARG_PATH,	// NUL-terminated string
+	ARG_SOCKADDR,	// struct sockaddr, length in len_arg
+	ARG_INBUF,	// buffer the syscall reads, length in len_arg
+	ARG_OUTBUF,	// buffer the syscall fills, length is the result
+};
+
+struct arg_decoder {
+	enum arg_kind kind;
+	int arg;
+	int len_arg;
+};
+
+static const struct arg_decoder decoders[NR_SYSCALLS] = {
+	[SYS_open] = { ARG_PATH, 0, -1 },
+	[SYS_openat] = { ARG_PATH, 1, -1 },
+	[SYS_execve] = { ARG_PATH, 0, -1 },
+	[SYS_connect] = { ARG_SOCKADDR, 1, 2 },
+	[SYS_read] = { ARG_OUTBUF, 1, -1 },
+	[SYS_write] = { ARG_INBUF, 1, 2 },
+};
+
+/* Bytes fetched per decoded argument, set with -s; 0 disables decoding */
+static size_t decode_max = DECODE_DEFAULT_MAX;
 
+static char scratch[DECODE_SCRATCH_SIZE];
+static size_t scratch_used;
+
+static void *scratch_alloc(size_t len)
+{
+	if (len > sizeof(scratch) - scratch_used)
+		return NULL;
+	void *p = scratch + scratch_used;
+	scratch_used += len;
+	return p;
+}
+
+/*
+ * Read up to len bytes at addr in one process_vm_readv. The remote range
+ * is split at page boundaries: a transfer stops at the first iovec it
+ * can't complete, so an unmapped page only cuts the read short.
+ */
+static ssize_t vm_read(pid_t tid, uint64_t addr, void *buf, size_t len)
+{
+	struct iovec local = { buf, len };
+	struct iovec remote[VM_READ_MAX / 4096 + 2];
+	size_t pagesz = 4096;
+	unsigned long n = 0;
+
+	while (len > 0 && n < sizeof(remote) / sizeof(remote[0])) {
+		size_t chunk = pagesz - (addr & (pagesz - 1));
+		if (chunk > len)
+			chunk = len;
+		remote[n].iov_base = (void *) (uintptr_t) addr;
+		remote[n].iov_len = chunk;
+		n++;
+		addr += chunk;
+		len -= chunk;
+	}
+	return process_vm_readv(tid, &local, 1, remote, n, 0);
+}
+
+/* Render bytes as a C string literal; "..." marks truncation */
+static const char *quote(const unsigned char *buf, size_t len, bool truncated)
+{
+	char *out = scratch_alloc(4 * len + 6);
+	if (out == NULL)
+		return NULL;
+
+	char *p = out;
+	*p++ = '"';
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		switch (c) {
+		case '\n': *p++ = '\\'; *p++ = 'n'; break;
+		case '\t': *p++ = '\\'; *p++ = 't'; break;
+		case '\r': *p++ = '\\'; *p++ = 'r'; break;
+		case '\\': *p++ = '\\'; *p++ = '\\'; break;
+		case '"': *p++ = '\\'; *p++ = '"'; break;
+		default:
+			if (isprint(c))
+				*p++ = c;
+			else
+				p += sprintf(p, "\\x%02x", c);
+		}
+	}
+	*p++ = '"';
+	if (truncated) {
+		memcpy(p, "...", 3);
+		p += 3;
+	}
+	*p = '\0';
+	return out;
+}
+
+static const char *decode_path(pid_t tid, uint64_t addr)
+{
+	unsigned char *buf = scratch_alloc(decode_max);
+	if (buf == NULL)
+		return NULL;
+
+	ssize_t n = vm_read(tid, addr, buf, decode_max);
+	if (n <= 0)
+		return NULL;
+
+	unsigned char *nul = memchr(buf, '\0', n);
+	return nul ? quote(buf, nul - buf, false) : quote(buf, n, true);
+}
+
+static const char *decode_buf(pid_t tid, uint64_t addr, uint64_t len)
+{
+	size_t want = len < decode_max ? len : decode_max;
+	unsigned char *buf = scratch_alloc(want);
+	if (buf == NULL || want == 0)
+		return NULL;
+
+	ssize_t n = vm_read(tid, addr, buf, want);
+	if (n <= 0)
+		return NULL;
+	return quote(buf, n, (uint64_t) n < len);
+}
+
+static const char *decode_sockaddr(pid_t tid, uint64_t addr, uint64_t len)
+{
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	if (len > sizeof(ss))
+		len = sizeof(ss);
+	if (len < sizeof(sa_family_t) || vm_read(tid, addr, &ss, len) != (ssize_t) len)
+		return NULL;
+
+	char *out = scratch_alloc(INET6_ADDRSTRLEN + sizeof(struct sockaddr_un) + 32);
+	if (out == NULL)
+		return NULL;
+
+	char host[INET6_ADDRSTRLEN];
+	switch (ss.ss_family) {
+	case AF_UNIX: {
+		const struct sockaddr_un *sun = (const struct sockaddr_un *) &ss;
+		size_t pathlen = len - offsetof(struct sockaddr_un, sun_path);
+		if (pathlen == 0) {
+			strcpy(out, "{AF_UNIX}");
+		} else if (sun->sun_path[0] == '\0') {
+			// Abstract socket: not NUL-terminated, length is significant
+			sprintf(out, "{AF_UNIX, @%.*s}", (int) pathlen - 1, sun->sun_path + 1);
+		} else {
+			sprintf(out, "{AF_UNIX, %.*s}", (int) strnlen(sun->sun_path, pathlen),
+					sun->sun_path);
+		}
+		break;
+	}
+	case AF_INET: {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) &ss;
+		inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+		sprintf(out, "{AF_INET, %s:%u}", host, ntohs(sin->sin_port));
+		break;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) &ss;
+		inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+		sprintf(out, "{AF_INET6, [%s]:%u}", host, ntohs(sin6->sin6_port));
+		break;
+	}
+	default:
+		sprintf(out, "{family=%u}", ss.ss_family);
+	}
+	return out;
+}
+
+/*
+ * Print the decoded argument of rec below its entry lines, or below its
+ * result for buffers the kernel fills in.
+ */
+static void decode_arg(const struct mtrace_record *rec, bool at_exit)
+{
+	if (decode_max == 0 || rec->nr >= NR_SYSCALLS)
+		return;
+
+	const struct arg_decoder *d = &decoders[rec->nr];
+	if (d->kind == ARG_NONE || (d->kind == ARG_OUTBUF) != at_exit)
+		return;
+
+	scratch_used = 0;
+	uint64_t addr = rec->args[d->arg];
+	const char *s = NULL;
+	switch (d->kind) {
+	case ARG_PATH:
+		s = decode_path(rec->tid, addr);
+		break;
+	case ARG_SOCKADDR:
+		s = decode_sockaddr(rec->tid, addr, rec->args[d->len_arg]);
+		break;
+	case ARG_INBUF:
+		s = decode_buf(rec->tid, addr, rec->args[d->len_arg]);
+		break;
+	case ARG_OUTBUF:
+		if (!(rec->flags & MTRACE_REC_NORET) && rec->ret > 0)
+			s = decode_buf(rec->tid, addr, rec->ret);
+		break;
+	case ARG_NONE:
+		break;
+	}
+	if (s != NULL)
+		fprintf(stderr, "arg%d=%s\n", d->arg, s);
+}
+
+/* Text lines carry the tid once more than one thread is being traced */
+static void emit_entry(const struct mtrace_record *rec)
+{
+	if (ring != NULL || summary != NULL)
+		return;
+	if (ntracees > 1)
+		fprintf(stderr, "[%u] ", rec->tid);
+	mtrace_print_entry(stderr, rec);
+	decode_arg(rec, false);
+}
+
+static void emit_exit(const struct mtrace_record *rec)
+{
+	if (summary != NULL)
+		summary_account(rec);
+	if (ring != NULL)
+		ring_append(ring, rec);
+	if (ring != NULL || summary != NULL)
+		return;
+	if (ntracees > 1)
+		fprintf(stderr, "[%u]", rec->tid);
+	mtrace_print_exit(stderr, rec);
+	decode_arg(rec, true);
+}
+
+/* Syscalls that never come back, so there is no exit stop to wait for */
+static bool syscall_returns(long long nr)
+{
+	return nr != SYS_exit && nr != SYS_exit_group;
+}
+
+/*
+ * Symbolization for -k. The ELF symbol table of every file seen in a
+ * tracee's executable mappings is loaded once and kept sorted; the
+ * mappings of each process are parsed from /proc/PID/maps once and again
+ * only when an address falls outside all of them, or the process execs.
+ */
+struct elf_sym {
+	uint64_t addr;
+	uint64_t size;
+	const char *name;
+};
+
+struct elf_file {
+	char *path;
+	const char *base;	// basename of path, for addresses with no symbol
+	void *map;
+	size_t maplen;
+	const Elf64_Phdr *phdrs;
+	size_t nphdrs;
+	struct elf_sym *syms;
+	size_t nsyms;
+	struct elf_file *next;
+};
+
+static struct elf_file *elf_files;
+
+struct mapping {
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	struct elf_file *elf;	// NULL for anonymous and special mappings
+};
+
+struct proc_maps {
+	pid_t tgid;
+	struct mapping *maps;
+	size_t nmaps;
+	struct proc_maps *next;
+};
+
+static struct proc_maps *proc_maps;
+
+static int elf_sym_cmp(const void *a, const void *b)
+{
+	const struct elf_sym *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Function symbols of the file, from .symtab or else .dynsym */
+static void elf_load_syms(struct elf_file *elf)
+{
+	const Elf64_Ehdr *eh = elf->map;
+	if (eh->e_shoff == 0 || eh->e_shoff + (uint64_t) eh->e_shnum * sizeof(Elf64_Shdr) > elf->maplen)
+		return;
+	const Elf64_Shdr *sh = (const Elf64_Shdr *) ((const char *) elf->map + eh->e_shoff);
+
+	const Elf64_Shdr *symtab = NULL;
+	for (int i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB)
+			symtab = &sh[i];
+		else if (sh[i].sh_type == SHT_DYNSYM && symtab == NULL)
+			symtab = &sh[i];
+	}
+	if (symtab == NULL || symtab->sh_link >= eh->e_shnum ||
+		symtab->sh_offset + symtab->sh_size > elf->maplen)
+		return;
+	const Elf64_Shdr *strtab = &sh[symtab->sh_link];
+	if (strtab->sh_offset + strtab->sh_size > elf->maplen)
+		return;
+
+	const Elf64_Sym *syms = (const Elf64_Sym *) ((const char *) elf->map + symtab->sh_offset);
+	const char *strs = (const char *) elf->map + strtab->sh_offset;
+	size_t n = symtab->sh_size / sizeof(Elf64_Sym);
+
+	elf->syms = calloc(n ? n : 1, sizeof(*elf->syms));
+	if (elf->syms == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0 ||
+			syms[i].st_shndx == SHN_UNDEF || syms[i].st_name >= strtab->sh_size)
+			continue;
+		elf->syms[elf->nsyms++] = (struct elf_sym) {
+			syms[i].st_value, syms[i].st_size, strs + syms[i].st_name
+		};
+	}
+	qsort(elf->syms, elf->nsyms, sizeof(*elf->syms), elf_sym_cmp);
+}
+
+/* Files that can't be read are cached too, with no symbols */
+static struct elf_file *elf_get(const char *path)
+{
+	for (struct elf_file *elf = elf_files; elf; elf = elf->next) {
+		if (strcmp(elf->path, path) == 0)
+			return elf;
+	}
+
+	struct elf_file *elf = calloc(1, sizeof(*elf));
+	if (elf == NULL || (elf->path = strdup(path)) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	const char *slash = strrchr(elf->path, '/');
+	elf->base = slash ? slash + 1 : elf->path;
+	elf->next = elf_files;
+	elf_files = elf;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1)
+		return elf;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return elf;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return elf;
+
+	const Elf64_Ehdr *eh = map;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+		eh->e_phoff + (uint64_t) eh->e_phnum * sizeof(Elf64_Phdr) > (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		return elf;
+	}
+	elf->map = map;
+	elf->maplen = st.st_size;
+	elf->phdrs = (const Elf64_Phdr *) ((const char *) map + eh->e_phoff);
+	elf->nphdrs = eh->e_phnum;
+	elf_load_syms(elf);
+	return elf;
+}
+
+/* The name of the function containing vaddr, or NULL */
+static const char *elf_lookup(const struct elf_file *elf, uint64_t vaddr)
+{
+	size_t lo = 0, hi = elf->nsyms;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (elf->syms[mid].addr <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	const struct elf_sym *sym = &elf->syms[lo - 1];
+	if (sym->size != 0 && vaddr >= sym->addr + sym->size)
+		return NULL;
+	return sym->name;
+}
+
+/* Convert a file offset to the virtual address the ELF file links it at */
+static uint64_t elf_vaddr(const struct elf_file *elf, uint64_t off)
+{
+	for (size_t i = 0; i < elf->nphdrs; i++) {
+		const Elf64_Phdr *ph = &elf->phdrs[i];
+		if (ph->p_type == PT_LOAD && off >= ph->p_offset && off < ph->p_offset + ph->p_filesz)
+			return off - ph->p_offset + ph->p_vaddr;
+	}
+	return off;
+}
+
+static void maps_load(struct proc_maps *pm)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/maps", pm->tgid);
+	free(pm->maps);
+	pm->maps = NULL;
+	pm->nmaps = 0;
+
+	FILE *f = fopen(path, "re");
+	if (f == NULL)
+		return;
+
+	size_t cap = 0;
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long start, end, offset;
+		char perms[5];
+		int pathpos = 0;
+		if (sscanf(line, "%llx-%llx %4s %llx %*s %*s %n",
+				   &start, &end, perms, &offset, &pathpos) < 4 || perms[2] != 'x')
+			continue;
+
+		if (pm->nmaps == cap) {
+			cap = cap ? cap * 2 : 64;
+			pm->maps = realloc(pm->maps, cap * sizeof(*pm->maps));
+			if (pm->maps == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		char *name = line + pathpos;
+		name[strcspn(name, "\n")] = '\0';
+		pm->maps[pm->nmaps++] = (struct mapping) {
+			start, end, offset, name[0] == '/' ? elf_get(name) : NULL
+		};
+	}
+	fclose(f);
+}
+
+static struct proc_maps *maps_get(pid_t tgid)
+{
+	for (struct proc_maps *pm = proc_maps; pm; pm = pm->next) {
+		if (pm->tgid == tgid)
+			return pm;
+	}
+
+	struct proc_maps *pm = calloc(1, sizeof(*pm));
+	if (pm == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	pm->tgid = tgid;
+	pm->next = proc_maps;
+	proc_maps = pm;
+	maps_load(pm);
+	return pm;
+}
+
+/* Forget the mappings of a process that exec'd, or of a reused pid */
+static void maps_forget(pid_t tgid)
+{
+	for (struct proc_maps **pp = &proc_maps; *pp; pp = &(*pp)->next) {
+		if ((*pp)->tgid == tgid) {
+			struct proc_maps *pm = *pp;
+			*pp = pm->next;
+			free(pm->maps);
+			free(pm);
+			return;
+		}
+	}
+}
+
+static const struct mapping *maps_find(const struct proc_maps *pm, uint64_t addr)
+{
+	size_t lo = 0, hi = pm->nmaps;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (addr < pm->maps[mid].start)
+			hi = mid;
+		else if (addr >= pm->maps[mid].end)
+			lo = mid + 1;
+		else
+			return &pm->maps[mid];
+	}
+	return NULL;
+}
+
+/*
+ * Frame name for addr: the function, else the [file] it is in, else
+ * [unknown]. Names point into the symbol tables and stay valid.
+ */
+static const char *symbolize(struct proc_maps *pm, uint64_t addr, bool *reloaded)
+{
+	const struct mapping *m = maps_find(pm, addr);
+	if (m == NULL && !*reloaded) {
+		// Mapped since the maps were read, by dlopen() or the like
+		*reloaded = true;
+		maps_load(pm);
+		m = maps_find(pm, addr);
+	}
+	if (m == NULL || m->elf == NULL)
+		return "[unknown]";
+
+	const char *name = elf_lookup(m->elf, elf_vaddr(m->elf, addr - m->start + m->offset));
+	if (name != NULL)
+		return name;
+
+	static char file[PATH_MAX + 2];
+	snprintf(file, sizeof(file), "[%s]", m->elf->base);
+	return file;
+}
+
+/*
+ * Folded stacks, one line per distinct "syscall;outermost;...;innermost"
+ * with the total latency of the syscalls made from it, in ns.
+ */
+struct folded {
+	char *key;
+	uint64_t ns;
+	struct folded *next;
+};
+
+static struct folded *folded[FOLDED_BUCKETS];
+
+static void folded_add(const char *key, uint64_t ns)
+{
+	uint32_t h = 2166136261u;
+	for (const char *p = key; *p; p++)
+		h = (h ^ (unsigned char) *p) * 16777619u;
+	h &= FOLDED_BUCKETS - 1;
+
+	for (struct folded *f = folded[h]; f; f = f->next) {
+		if (strcmp(f->key, key) == 0) {
+			f->ns += ns;
+			return;
+		}
+	}
+
+	struct folded *f = malloc(sizeof(*f));
+	if (f == NULL || (f->key = strdup(key)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	f->ns = ns;
+	f->next = folded[h];
+	folded[h] = f;
+}
+
+/* Registered with atexit(), like summary_print() */
+static void stacks_print(void)
+{
+	for (size_t i = 0; i < FOLDED_BUCKETS; i++) {
+		for (struct folded *f = folded[i]; f; f = f->next)
+			fprintf(stacks_out, "%s %llu\n", f->key, (unsigned long long) f->ns);
+	}
+	fclose(stacks_out);
+}
+
+/*
+ * Per-thread tracing state, kept in a hash table keyed by tid so that a
+ * stop is dispatched in O(1) however many threads are being followed.
+ */
+struct tracee {
+	pid_t tid;
+	// Between the entry and the exit stop of a syscall
+	bool in_syscall;
+	// The current syscall is selected and inside a duty burst
+	bool recording;
+	// A SIGSTOP of ours is due: the auto-attach stop, or a burst wakeup
+	bool sigstop_pending;
+	struct mtrace_record rec;
+	// -k: thread group, and the call chain sampled at the syscall's entry
+	pid_t tgid;
+	int depth;
+	uint64_t stack[STACK_MAX_DEPTH];
+	struct tracee *next;
+};
+
+static struct tracee **tracees;
+static size_t ntracee_buckets;
+
+/* Attached with -p through PTRACE_SEIZE, rather than forked and TRACEME'd */
+static bool seized;
+
+/* The child runs under the -e seccomp filter; only -p traces without it */
+static bool seccomp_filtered;
+
+/*
+ * Sampling selected with --duty ON/PERIOD: syscalls are traced for the
+ * first ON of every PERIOD, and the tracees run under PTRACE_CONT in
+ * between. duty_period_ns == 0 traces all the time.
+ */
+static uint64_t duty_on_ns;
+static uint64_t duty_period_ns;
+static uint64_t duty_start;
+static bool duty_on = true;
+
+static volatile sig_atomic_t interrupted;
+
+static size_t tracee_hash(pid_t tid)
+{
+	return ((uint32_t) tid * 2654435761u) & (ntracee_buckets - 1);
+}
+
+static struct tracee *tracee_find(pid_t tid)
+{
+	if (ntracee_buckets == 0)
+		return NULL;
+	for (struct tracee *t = tracees[tracee_hash(tid)]; t; t = t->next) {
+		if (t->tid == tid)
+			return t;
+	}
+	return NULL;
+}
+
+static void tracee_rehash(size_t nbuckets)
+{
+	struct tracee **old = tracees;
+	size_t nold = ntracee_buckets;
+
+	tracees = calloc(nbuckets, sizeof(*tracees));
+	if (tracees == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	ntracee_buckets = nbuckets;
+
+	for (size_t i = 0; i < nold; i++) {
+		struct tracee *t = old[i];
+		while (t) {
+			struct tracee *next = t->next;
+			size_t h = tracee_hash(t->tid);
+			t->next = tracees[h];
+			tracees[h] = t;
+			t = next;
+		}
+	}
+	free(old);
+}
+
+static struct tracee *tracee_add(pid_t tid)
+{
+	if (ntracees + 1 > ntracee_buckets / 4 * 3)
+		tracee_rehash(ntracee_buckets ? ntracee_buckets * 2 : 64);
+
+	struct tracee *t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	t->tid = tid;
+	t->sigstop_pending = true;
+
+	size_t h = tracee_hash(tid);
+	t->next = tracees[h];
+	tracees[h] = t;
+	ntracees++;
+	return t;
+}
+
+static void tracee_remove(struct tracee *t)
+{
+	struct tracee **pp = &tracees[tracee_hash(t->tid)];
+	while (*pp != t)
+		pp = &(*pp)->next;
+	*pp = t->next;
+	ntracees--;
+	free(t);
+}
+
+/*
+ * Let t run until its next stop. Without a seccomp filter every syscall
+ * stops while a burst is on; with one, PTRACE_SYSCALL is only needed to
+ * pick up the exit stop of a selected syscall.
+ */
+static void tracee_resume(struct tracee *t, int sig)
+{
+	enum __ptrace_request req = PTRACE_CONT;
+	if (t->in_syscall || (!seccomp_filtered && duty_on))
+		req = PTRACE_SYSCALL;
+
+	// ESRCH: killed meanwhile, waitpid() will report its death
+	if (ptrace(req, t->tid, 0, sig) == -1 && errno != ESRCH) {
+		perror("ptrace resuming");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Bring a tracee running under PTRACE_CONT back to a stop */
+static void tracee_interrupt(struct tracee *t)
+{
+	if (seized) {
+		ptrace(PTRACE_INTERRUPT, t->tid, 0, 0);
+	} else if (!t->sigstop_pending) {
+		t->sigstop_pending = true;
+		syscall(SYS_tkill, t->tid, SIGSTOP);
+	}
+}
+
+static pid_t tgid_of(pid_t tid)
+{
+	char path[64], line[128];
+	snprintf(path, sizeof(path), "/proc/%d/status", tid);
+	FILE *f = fopen(path, "re");
+	if (f == NULL)
+		return tid;
+
+	pid_t tgid = tid;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Tgid: %d", &tgid) == 1)
+			break;
+	}
+	fclose(f);
+	return tgid;
+}
+
+/*
+ * Walk the frame-pointer chain from rbp at a syscall entry. The stack above
+ * rsp is copied in a single process_vm_readv and the walk stays inside that
+ * copy, so it ends at the first frame that is not a plausible, higher
+ * address on the same stack. Code built without frame pointers cuts the
+ * chain short or skips callers.
+ */
+static void stack_sample(struct tracee *t, const struct syscall_stop *stop)
+{
+	static unsigned char window[STACK_WINDOW];
+
+	t->depth = 0;
+	t->stack[t->depth++] = stop->rip;
+
+	ssize_t n = vm_read(t->tid, stop->rsp, window, sizeof(window));
+	if (n <= 0)
+		return;
+
+	uint64_t lo = stop->rsp, hi = stop->rsp + n;
+	uint64_t fp = stop->rbp;
+	while (t->depth < STACK_MAX_DEPTH && fp >= lo && fp + 16 <= hi && (fp & 7) == 0) {
+		uint64_t frame[2];
+		memcpy(frame, window + (fp - lo), sizeof(frame));
+		if (frame[1] == 0)
+			break;
+		t->stack[t->depth++] = frame[1];
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+}
+
+/* Fold the stack sampled at t's syscall entry, weighted by its latency */
+static void stacks_account(struct tracee *t, uint64_t latency)
+{
+	static char key[STACK_KEY_MAX];
+
+	if (t->depth == 0)
+		return;
+	if (t->tgid == 0)
+		t->tgid = tgid_of(t->tid);
+	struct proc_maps *pm = maps_get(t->tgid);
+
+	const char *name = t->rec.nr < NR_SYSCALLS ? syscallent[t->rec.nr] : NULL;
+	int len = name ? snprintf(key, sizeof(key), "%s", name)
+		: snprintf(key, sizeof(key), "syscall_%u", t->rec.nr);
+
+	bool reloaded = false;
+	for (int i = t->depth - 1; i >= 0 && len < (int) sizeof(key); i--) {
+		// Return addresses point past the call, which may be another function
+		uint64_t pc = i == 0 ? t->stack[i] : t->stack[i] - 1;
+		len += snprintf(key + len, sizeof(key) - len, ";%s", symbolize(pm, pc, &reloaded));
+	}
+	folded_add(key, latency);
+	t->depth = 0;
+}
+
+static bool fetch_syscall_info(pid_t tid, struct syscall_stop *stop)
+{
+	struct __ptrace_syscall_info info;
+
+	if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) == -1)
+		return false;
+
+	stop->op = info.op;
+	stop->rip = info.instruction_pointer;
+	stop->rsp = info.stack_pointer;
+	stop->rbp = 0;
+	stop->have_rbp = false;
+	switch (info.op) {
+	case PTRACE_SYSCALL_INFO_ENTRY:
+		stop->nr = info.entry.nr;
+		memcpy(stop->args, info.entry.args, sizeof(stop->args));
+		break;
+	case PTRACE_SYSCALL_INFO_SECCOMP:
+		stop->nr = info.seccomp.nr;
+		memcpy(stop->args, info.seccomp.args, sizeof(stop->args));
+		break;
+	case PTRACE_SYSCALL_INFO_EXIT:
+		stop->ret = info.exit.rval;
+		break;
+	}
+	return true;
+}
+
+static bool fetch_regs(pid_t tid, struct syscall_stop *stop)
+{
+	struct user_regs_struct regs;
+
+	if (ptrace(PTRACE_GETREGS, tid, 0, &regs) == -1)
+		return false;
+
+	// rax holds -ENOSYS at entry; anything else can only be an exit
+	stop->op = (long long) regs.rax == -ENOSYS ? PTRACE_SYSCALL_INFO_NONE
+		: PTRACE_SYSCALL_INFO_EXIT;
+	stop->nr = regs.orig_rax;
+	stop->args[0] = regs.rdi;
+	stop->args[1] = regs.rsi;
+	stop->args[2] = regs.rdx;
+	stop->args[3] = regs.r10;
+	stop->args[4] = regs.r8;
+	stop->args[5] = regs.r9;
+	stop->ret = regs.rax;
+	stop->rip = regs.rip;
+	stop->rsp = regs.rsp;
+	stop->rbp = regs.rbp;
+	stop->have_rbp = true;
+	return true;
+}
+
+/*
+ * Read the syscall t is stopped in. PTRACE_GET_SYSCALL_INFO copies out
+ * only nr, args, ret and rip, and tells entry from exit by itself; the
+ * full register set is read only where it is unavailable.
+ */
+static bool fetch_syscall(struct tracee *t, struct syscall_stop *stop)
+{
+	if (use_syscall_info) {
+		if (fetch_syscall_info(t->tid, stop))
+			return true;
+		if (errno == EIO || errno == EINVAL)
+			use_syscall_info = false;
+	}
+	if (!use_syscall_info && fetch_regs(t->tid, stop))
+		return true;
+
+	if (errno == ESRCH)
+		return false;
+	perror("ptrace fetching syscall");
+	exit(EXIT_FAILURE);
+}
+
+static void on_syscall_entry(struct tracee *t, const struct syscall_stop *stop)
+{
+	t->recording = duty_on && (ntraced == 0 ||
+							   (stop->nr < NR_SYSCALLS && traced[stop->nr]));
+	if (t->recording) {
+		fill_entry(&t->rec, t->tid, stop);
+		emit_entry(&t->rec);
+		if (stacks_out != NULL)
+			stack_sample(t, stop);
+	}
+
+	// Without the filter every exit stops anyway
+	if (!seccomp_filtered) {
+		t->in_syscall = true;
+		return;
+	}
+	if (t->recording && syscall_returns(t->rec.nr)) {
+		t->in_syscall = true;
+	} else if (t->recording) {
+		t->rec.flags |= MTRACE_REC_NORET;
+		emit_exit(&t->rec);
+	}
+}
+
+/* Syscall-stop: an entry when tracing everything, otherwise always an exit */
+static void on_syscall_stop(struct tracee *t)
+{
+	struct syscall_stop stop;
+	if (!fetch_syscall(t, &stop))
+		return;
+
+	bool entry = stop.op == PTRACE_SYSCALL_INFO_NONE ? !t->in_syscall
+		: stop.op != PTRACE_SYSCALL_INFO_EXIT;
+	if (entry) {
+		on_syscall_entry(t, &stop);
+	} else if (t->in_syscall) {
+		/* Record system call result */
+		if (t->recording) {
+			fill_exit(&t->rec, &stop);
+			emit_exit(&t->rec);
+			if (stacks_out != NULL)
+				stacks_account(t, now_ns() - t->rec.ts);
+		}
+		t->in_syscall = false;
+	}
+	// An exit without an entry: attached or woken up mid-syscall
+}
+
+static void on_event_stop(struct tracee *t, int event)
+{
+	unsigned long msg;
+	struct syscall_stop stop;
+
+	switch (event) {
+	case PTRACE_EVENT_SECCOMP:
+		if (fetch_syscall(t, &stop))
+			on_syscall_entry(t, &stop);
+		break;
+	case PTRACE_EVENT_CLONE:
+	case PTRACE_EVENT_FORK:
+	case PTRACE_EVENT_VFORK:
+		if (ptrace(PTRACE_GETEVENTMSG, t->tid, 0, &msg) == -1)
+			break;
+		// The child's own first stop may already have been seen
+		if (tracee_find(msg) == NULL)
+			tracee_add(msg);
+		if (event != PTRACE_EVENT_CLONE)
+			maps_forget(msg);
+		break;
+	case PTRACE_EVENT_EXEC:
+		maps_forget(t->tgid ? t->tgid : t->tid);
+		// A non-leader thread that execs takes over the leader's tid
+		if (ptrace(PTRACE_GETEVENTMSG, t->tid, 0, &msg) == -1 ||
+			(pid_t) msg == t->tid)
+			break;
+		struct tracee *former = tracee_find(msg);
+		if (former != NULL) {
+			t->in_syscall = former->in_syscall;
+			t->recording = former->recording;
+			t->rec = former->rec;
+			t->rec.tid = t->tid;
+			t->depth = former->depth;
+			memcpy(t->stack, former->stack, sizeof(t->stack));
+			tracee_remove(former);
+		}
+		break;
+	}
+}
+
+static bool is_stop_signal(int sig)
+{
+	return sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU;
+}
+
+static bool is_group_stop(struct tracee *t, int sig)
+{
+	siginfo_t si;
+
+	if (!is_stop_signal(sig))
+		return false;
+	return ptrace(PTRACE_GETSIGINFO, t->tid, 0, &si) == -1 && errno == EINVAL;
+}
+
+static void on_exit_status(struct tracee *t)
+{
+	if (t->in_syscall && t->recording) {
+		// Died inside the syscall, e.g. exit_group(2) or a fatal signal
+		t->rec.flags |= MTRACE_REC_NORET;
+		emit_exit(&t->rec);
+		if (stacks_out != NULL)
+			stacks_account(t, now_ns() - t->rec.ts);
+	}
+	tracee_remove(t);
+}
+
+/*
+ * Switch between bursts and pauses. Turning a burst off takes effect as
+ * each tracee is next resumed; turning one on needs every tracee stopped
+ * once, so that it can be resumed with PTRACE_SYSCALL.
+ */
+static void duty_update(void)
+{
+	if (duty_period_ns == 0)
+		return;
+
+	bool on = (now_ns() - duty_start) % duty_period_ns < duty_on_ns;
+	if (on == duty_on)
+		return;
+	duty_on = on;
+	if (!on)
+		return;
+
+	for (size_t i = 0; i < ntracee_buckets; i++) {
+		for (struct tracee *t = tracees[i]; t; t = t->next)
+			tracee_interrupt(t);
+	}
+}
+
+static void on_signal(int sig)
+{
+	if (sig != SIGALRM)
+		interrupted = 1;
+}
+
+/*
+ * SIGINT and SIGTERM end tracing through exit(), so that the ring is
+ * flushed. SIGALRM ticks at the shorter of the two duty phases and only
+ * serves to break waitpid() out for duty_update().
+ */
+static void install_signals(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (duty_period_ns == 0)
+		return;
+
+	sigaction(SIGALRM, &sa, NULL);
+	uint64_t tick = duty_on_ns < duty_period_ns - duty_on_ns ?
+		duty_on_ns : duty_period_ns - duty_on_ns;
+	struct itimerval it = {
+		.it_interval = { tick / 1000000000ULL, tick % 1000000000ULL / 1000 },
+		.it_value = { tick / 1000000000ULL, tick % 1000000000ULL / 1000 },
+	};
+	if (it.it_interval.tv_sec == 0 && it.it_interval.tv_usec == 0)
+		it.it_interval.tv_usec = it.it_value.tv_usec = 1;
+	if (setitimer(ITIMER_REAL, &it, NULL) == -1) {
+		perror("setitimer");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Parse "10ms/1s" into the burst length and the period, in ns */
+static int parse_duty(const char *arg)
+{
+	uint64_t vals[2];
+	const char *p = arg;
+
+	for (int i = 0; i < 2; i++) {
+		char *end;
+		unsigned long long v = strtoull(p, &end, 10);
+		if (end == p)
+			return -1;
+
+		if (strncmp(end, "ns", 2) == 0) {
+			end += 2;
+		} else if (strncmp(end, "us", 2) == 0) {
+			v *= 1000ULL;
+			end += 2;
+		} else if (strncmp(end, "ms", 2) == 0) {
+			v *= 1000000ULL;
+			end += 2;
+		} else if (*end == 's') {
+			v *= 1000000000ULL;
+			end += 1;
+		} else {
+			return -1;
+		}
+
+		vals[i] = v;
+		if (*end != (i == 0 ? '/' : '\0'))
+			return -1;
+		p = end + 1;
+	}
+
+	if (vals[0] == 0 || vals[0] >= vals[1])
+		return -1;
+	duty_on_ns = vals[0];
+	duty_period_ns = vals[1];
+	return 0;
+}
+
+/*
+ * Trace root and every thread and process it creates. A single
+ * waitpid(-1, __WALL) loop dispatches each stop to the state of the tid
+ * that reported it, until the last tracee is gone.
+ */
+static void trace_loop(pid_t root)
+{
+	int status;
+	int exit_code = EXIT_SUCCESS;
+
+	duty_start = now_ns();
+	install_signals();
+
+	while (ntracees > 0 && !interrupted) {
+		duty_update();
+
+		pid_t tid = waitpid(-1, &status, __WALL);
+		if (tid == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+
+		struct tracee *t = tracee_find(tid);
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == root)
+				exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+					: 128 + WTERMSIG(status);
+			if (t != NULL)
+				on_exit_status(t);
+			continue;
+		}
+		if (!WIFSTOPPED(status))
+			continue;
+		if (t == NULL)
+			t = tracee_add(tid);
+
+		int sig = WSTOPSIG(status);
+		int event = status >> 16;
+		if (sig == (SIGTRAP | 0x80)) {
+			on_syscall_stop(t);
+			sig = 0;
+		} else if (event == PTRACE_EVENT_STOP && is_stop_signal(sig) &&
+				   !t->sigstop_pending) {
+			// Group-stop of a seized tracee: stay stopped until SIGCONT
+			if (ptrace(PTRACE_LISTEN, tid, 0, 0) == -1 && errno != ESRCH) {
+				perror("ptrace listen");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		} else if (event != 0) {
+			// The auto-attach stop of a seized tracee
+			if (event == PTRACE_EVENT_STOP)
+				t->sigstop_pending = false;
+			on_event_stop(t, event);
+			sig = 0;
+		} else if (t->sigstop_pending && sig == SIGSTOP) {
+			// Ours, the one pending: a syscall or event stop may come
+			// before it, and must not use it up
+			t->sigstop_pending = false;
+			sig = 0;
+		} else if (is_group_stop(t, sig)) {
+			sig = 0;
+		}
+		tracee_resume(t, sig);
+	}
+	exit(exit_code);
+}
+
+static long trace_options(void)
+{
+	long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC |
+		PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+
+	// A process we attached to outlives the tracer
+	if (!seized)
+		opts |= PTRACE_O_EXITKILL;
+	if (seccomp_filtered)
+		opts |= PTRACE_O_TRACESECCOMP;
+	return opts;
+}
+
+/*
+ * Seize every thread of pid. Threads started by a thread that is not
+ * seized yet are picked up by rescanning until no new tid shows up; the
+ * ones started after that are auto-attached.
+ */
+static void attach_pid(pid_t pid)
+{
+	char taskdir[64];
+	snprintf(taskdir, sizeof(taskdir), "/proc/%d/task", pid);
+
+	bool added;
+	do {
+		added = false;
+		DIR *dir = opendir(taskdir);
+		if (dir == NULL) {
+			perror("opendir");
+			exit(EXIT_FAILURE);
+		}
+
+		struct dirent *de;
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			pid_t tid = atoi(de->d_name);
+			if (tracee_find(tid) != NULL)
+				continue;
+
+			if (ptrace(PTRACE_SEIZE, tid, 0, trace_options()) == -1) {
+				if (errno == ESRCH)
+					continue;
+				perror("ptrace seize");
+				exit(EXIT_FAILURE);
+			}
+			struct tracee *t = tracee_add(tid);
+			t->sigstop_pending = false;
+			ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+			added = true;
+		}
+		closedir(dir);
+	} while (added);
+
+	fprintf(stderr, "attached to %d (%zu threads)\n", pid, ntracees);
+}
+
+static pid_t launch(int argc, char *argv[])
+{
 	struct stat progstat;
-	char *progname = argv[1];
+	char *progname = argv[optind];
 	if (stat(progname, &progstat) == -1) {
 		perror("stat()");
 		exit(1);
@@ -49,61 +1668,141 @@ int main(int argc, char *argv[])
 		// Child
 		printf("Child PID is %ld\n", (long) getpid());
 		printf("executing %s\n", progname);
-		printf("chld argv[1]: %s\n", argv[2]);
+		printf("chld argv[1]: %s\n", argv[optind + 1]);
 		printf("argc = %d\n", argc);
 		ptrace(PTRACE_TRACEME, 0, 0, 0);
-		execvp(progname, &argv[1]);
-	} else {
+		// Let the tracer set its options, PTRACE_O_TRACESECCOMP in
+		// particular, before the filter can return SECCOMP_RET_TRACE
+		raise(SIGSTOP);
+		if (seccomp_filtered && install_filter() == -1)
+			_exit(1);
+		execvp(progname, &argv[optind]);
+		perror("execvp");
+		_exit(1);
+	}
 
-		// Sync with PTRACE_TRACEME
-		waitpid(cpid, 0, 0);
-		ptrace(PTRACE_SETOPTIONS, cpid, 0, PTRACE_O_EXITKILL);
+	// Sync with the child's SIGSTOP, raised right after PTRACE_TRACEME
+	if (waitpid(cpid, 0, 0) == -1) {
+		perror("waitpid");
+		exit(EXIT_FAILURE);
+	}
+	if (ptrace(PTRACE_SETOPTIONS, cpid, 0, trace_options()) == -1) {
+		perror("ptrace setoptions");
+		exit(EXIT_FAILURE);
+	}
 
-		for (;;) {
-			if (ptrace(PTRACE_SYSCALL, cpid, 0, 0) == -1) {
-				perror("ptrace syscall");
+	struct tracee *t = tracee_add(cpid);
+	t->sigstop_pending = false;
+	tracee_resume(t, 0);
+	return cpid;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "duty", required_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 },
+	};
+	const char *outpath = NULL;
+	uint64_t ring_records = RING_DEFAULT_RECORDS;
+	pid_t attach = 0;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "+ce:o:b:Rp:s:k:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			summary = calloc(NR_SYSCALLS, sizeof(*summary));
+			if (summary == NULL) {
+				perror("calloc");
 				exit(EXIT_FAILURE);
 			}
-			if (waitpid(cpid, 0, 0) == -1) {
-				perror("waitpid");
-				exit(EXIT_FAILURE);
+			break;
+		case 'e':
+			if (parse_trace_expr(optarg) == -1)
+				exit(1);
+			break;
+		case 'o':
+			outpath = optarg;
+			break;
+		case 'R':
+			use_syscall_info = false;
+			break;
+		case 'b':
+			ring_records = strtoull(optarg, NULL, 0);
+			if (ring_records == 0) {
+				fprintf(stderr, "invalid ring size: %s\n", optarg);
+				exit(1);
 			}
-
-			struct user_regs_struct regs;
-			if (ptrace(PTRACE_GETREGS, cpid, 0, &regs) == -1) {
-				perror("ptrace getregs");
-				exit(EXIT_FAILURE);
+			break;
+		case 'p':
+			attach = atoi(optarg);
+			if (attach <= 0) {
+				fprintf(stderr, "invalid pid: %s\n", optarg);
+				exit(1);
 			}
-
-			long long syscall = regs.orig_rax;
-			fprintf(stderr, "0x%llx(0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx)\n",
-					syscall, regs.rdi, regs.rsi, regs.rdx, regs.r10, regs.r8, regs.r9);
-
-			fprintf(stderr, "rip=0x%llx\n", regs.rip);
-			fprintf(stderr, "rbp=0x%llx\n", regs.rbp);
-
-			if (ptrace(PTRACE_SYSCALL, cpid, 0, 0) == -1) {
-				perror("ptrace syscall resuming");
-				exit(EXIT_FAILURE);
+			break;
+		case 's': {
+			char *end;
+			unsigned long v = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || v > DECODE_MAX) {
+				fprintf(stderr, "invalid string size: %s (at most %d)\n",
+						optarg, DECODE_MAX);
+				exit(1);
 			}
-			if (waitpid(cpid, 0, 0) == -1) {
-				perror("waitpid");
-				exit(EXIT_FAILURE);
+			decode_max = v;
+			break;
+		}
+		case 'k':
+			stacks_out = fopen(optarg, "w");
+			if (stacks_out == NULL) {
+				perror(optarg);
+				exit(1);
 			}
-
-			/* Get system call result */
-			if (ptrace(PTRACE_GETREGS, cpid, 0, &regs) == -1) {
-				fputs(" = ?\n", stderr);
-				if (errno == ESRCH)
-					exit(regs.rdi); // system call was _exit(2) or similar
+			// rbp is only in the full register set
+			use_syscall_info = false;
+			break;
+		case 'D':
+			if (parse_duty(optarg) == -1) {
+				fprintf(stderr, "invalid duty cycle: %s\n", optarg);
+				exit(1);
 			}
-
-			/* Print system call result */
-			fprintf(stderr, " = %ld\n", (long)regs.rax);
-			fprintf(stderr, "rip -> 0x%llx\n", regs.rip);
+			break;
+		default:
+			usage();
+			exit(1);
 		}
-		exit(EXIT_SUCCESS);
 	}
 
+	if ((attach == 0) == (optind >= argc)) {
+		usage();
+		exit(1);
+	}
+
+	// A running process can't be given a filter, so -p filters in the tracer
+	seized = attach != 0;
+	seccomp_filtered = ntraced > 0 && !seized;
+	// Filtered syscalls stop whether a burst is on or not: there would
+	// be nothing to switch off
+	if (seccomp_filtered && duty_period_ns != 0) {
+		fprintf(stderr, "--duty and -e only go together with -p\n");
+		exit(1);
+	}
+
+	if (outpath != NULL) {
+		ring = ring_open(outpath, ring_records);
+		if (ring == NULL)
+			exit(EXIT_FAILURE);
+		atexit(ring_close);
+	}
+	if (summary != NULL)
+		atexit(summary_print);
+	if (stacks_out != NULL)
+		atexit(stacks_print);
+
+	if (seized)
+		attach_pid(attach);
+	else
+		attach = launch(argc, argv);
+	trace_loop(attach);
+
     return 0;
 }
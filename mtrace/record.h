@@ -0,0 +1,68 @@
+/*
+ * Binary trace format shared by mtrace (-o) and mtrace-decode.
+ *
+ * A ring file is a page-sized header followed by `capacity` fixed-size
+ * records. The tracer writes record number n into slot n % capacity and
+ * then publishes head = n + 1, so once head exceeds capacity the file holds
+ * the most recent `capacity` syscalls.
+ */
+
+#ifndef MTRACE_RECORD_H
+#define MTRACE_RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MTRACE_RING_MAGIC 0x474e4952434d544dULL /* "MTMCRING" */
+#define MTRACE_RING_VERSION 1
+#define MTRACE_RING_DATA_OFFSET 4096
+
+/* The syscall did not return (exit_group, or the tracee died), ret is unset */
+#define MTRACE_REC_NORET 0x1
+/* rbp was not captured: the fast fetch path does not read it */
+#define MTRACE_REC_NORBP 0x2
+
+struct mtrace_record {
+	uint32_t tid;
+	uint32_t nr;
+	uint64_t ts;		/* CLOCK_MONOTONIC at syscall entry, in ns */
+	uint64_t args[6];
+	int64_t ret;
+	uint64_t rip;
+	uint64_t rbp;
+	uint64_t flags;
+};
+
+struct mtrace_ring_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;	/* in records */
+	uint64_t head;		/* records written so far */
+	uint64_t flushed;	/* records known to be synced to the file */
+};
+
+static inline void mtrace_print_entry(FILE *out, const struct mtrace_record *rec)
+{
+	fprintf(out, "0x%llx(0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx, 0x%llx)\n",
+			(unsigned long long) rec->nr,
+			(unsigned long long) rec->args[0], (unsigned long long) rec->args[1],
+			(unsigned long long) rec->args[2], (unsigned long long) rec->args[3],
+			(unsigned long long) rec->args[4], (unsigned long long) rec->args[5]);
+
+	fprintf(out, "rip=0x%llx\n", (unsigned long long) rec->rip);
+	if (!(rec->flags & MTRACE_REC_NORBP))
+		fprintf(out, "rbp=0x%llx\n", (unsigned long long) rec->rbp);
+}
+
+static inline void mtrace_print_exit(FILE *out, const struct mtrace_record *rec)
+{
+	if (rec->flags & MTRACE_REC_NORET) {
+		fputs(" = ?\n", out);
+		return;
+	}
+	fprintf(out, " = %ld\n", (long) rec->ret);
+	fprintf(out, "rip -> 0x%llx\n", (unsigned long long) rec->rip);
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Tracer overhead benchmark. Runs each workload for a fixed number of
+ * iterations under several setups and prints one CSV row per run:
+ *
+ *   untraced   the workload alone
+ *   mtrace     mtrace with its text output sent to /dev/null
+ *   intercept  a blindreader-style tracer: a stop on every syscall, and
+ *              every 10th read() after the 5th fails with EPERM
+ *   sysjack    sysjack with its openat hook, whose activation never
+ *              matches the workloads' paths
+ *   sud        sudtrace, recording every syscall in-process through
+ *              Syscall User Dispatch
+ *
+ * The syscall count of a workload is taken once with a counting tracer and
+ * divided by each setup's wall time. Tracer CPU time is that of the tracer
+ * process alone, read from /proc before it is reaped.
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_ITERATIONS 100000
+
+struct run {
+	double wall;
+	double tracer_cpu;
+	bool ok;
+};
+
+void usage() {
+	printf(
+		"bench [-n ITERATIONS] [-m MTRACE] [-j SYSJACK] [-u SUDTRACE] <workload>...\n"
+		);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send the workload's output, and mtrace's, to /dev/null */
+static void silence(void)
+{
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd == -1) {
+		perror("open /dev/null");
+		_exit(1);
+	}
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+}
+
+/*
+ * Trace argv stopping on every syscall, blindreader-style. Returns the
+ * number of syscalls the tracee made.
+ */
+static long long trace_workload(char *const argv[], bool intercept)
+{
+	pid_t cpid = fork();
+	if (cpid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cpid == 0) {
+		// Child
+		silence();
+		ptrace(PTRACE_TRACEME, 0, 0, 0);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	// Sync with PTRACE_TRACEME
+	waitpid(cpid, 0, 0);
+	ptrace(PTRACE_SETOPTIONS, cpid, 0, PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
+
+	long long nsyscalls = 0;
+	long readcnt = 0;
+	bool in_syscall = false;
+	for (;;) {
+		int status;
+		if (ptrace(PTRACE_SYSCALL, cpid, 0, 0) == -1) {
+			perror("ptrace syscall");
+			exit(EXIT_FAILURE);
+		}
+		if (waitpid(cpid, &status, 0) == -1) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+
+		struct user_regs_struct regs;
+		if (ptrace(PTRACE_GETREGS, cpid, 0, &regs) == -1) {
+			perror("ptrace getregs");
+			exit(EXIT_FAILURE);
+		}
+
+		in_syscall = !in_syscall;
+		if (in_syscall) {
+			nsyscalls++;
+			if (regs.orig_rax == SYS_read)
+				readcnt++;
+		} else if (intercept && regs.orig_rax == SYS_read &&
+				   (readcnt % 10 == 0) && (readcnt > 5)) {
+			// Block this read
+			regs.rax = -EPERM;
+			ptrace(PTRACE_SETREGS, cpid, 0, &regs);
+		}
+	}
+	return nsyscalls;
+}
+
+/* CPU time of a process that has exited but not been reaped yet */
+static double zombie_cpu(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	// Skip "pid (comm) state" and the 10 fields before utime
+	unsigned long long utime, stime;
+	int n = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+				   &utime, &stime);
+	fclose(f);
+	if (n != 2)
+		return -1;
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Run argv, or the built-in intercepting tracer when argv is NULL, and
+ * time it until it exits.
+ */
+static struct run run_setup(char *const argv[], char *const workload[])
+{
+	struct run r = { 0 };
+	double start = now();
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		if (argv == NULL) {
+			trace_workload(workload, true);
+			_exit(0);
+		}
+		silence();
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	siginfo_t si;
+	if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) == -1) {
+		perror("waitid");
+		exit(EXIT_FAILURE);
+	}
+	r.wall = now() - start;
+	r.tracer_cpu = zombie_cpu(pid);
+
+	int status;
+	waitpid(pid, &status, 0);
+	r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	return r;
+}
+
+static void report(const char *workload, const char *setup, long iterations,
+				   long long nsyscalls, struct run r)
+{
+	if (!r.ok) {
+		printf("%s,%s,%ld,%lld,,,\n", workload, setup, iterations, nsyscalls);
+		fprintf(stderr, "%s under %s did not exit cleanly\n", workload, setup);
+		return;
+	}
+	printf("%s,%s,%ld,%lld,%.6f,%.0f,", workload, setup, iterations, nsyscalls,
+		   r.wall, nsyscalls / r.wall);
+	if (r.tracer_cpu >= 0)
+		printf("%.2f", r.tracer_cpu);
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = DEFAULT_ITERATIONS;
+	char *mtrace = NULL, *sysjack = NULL, *sudtrace = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:j:u:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'm':
+			mtrace = optarg;
+			break;
+		case 'j':
+			sysjack = optarg;
+			break;
+		case 'u':
+			sudtrace = optarg;
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (optind >= argc || iterations <= 0) {
+		usage();
+		exit(1);
+	}
+
+	char iters[32];
+	snprintf(iters, sizeof(iters), "%ld", iterations);
+
+	printf("workload,setup,iterations,syscalls,wall_s,syscalls_per_s,tracer_cpu_s\n");
+	for (int i = optind; i < argc; i++) {
+		char *workload[] = { argv[i], iters, NULL };
+		long long nsyscalls = trace_workload(workload, false);
+
+		struct run r = run_setup(workload, NULL);
+		// The workload is its own "tracer" here
+		r.tracer_cpu = 0;
+		report(argv[i], "untraced", iterations, nsyscalls, r);
+
+		if (mtrace != NULL) {
+			char *cmd[] = { mtrace, argv[i], iters, NULL };
+			report(argv[i], "mtrace", iterations, nsyscalls, run_setup(cmd, NULL));
+		}
+
+		report(argv[i], "intercept", iterations, nsyscalls, run_setup(NULL, workload));
+
+		if (sysjack != NULL) {
+			char *cmd[] = { sysjack, "-t", argv[i], "--", iters, NULL };
+			report(argv[i], "sysjack", iterations, nsyscalls, run_setup(cmd, NULL));
+		}
+
+		if (sudtrace != NULL) {
+			char *cmd[] = { sudtrace, argv[i], iters, NULL };
+			report(argv[i], "sud", iterations, nsyscalls, run_setup(cmd, NULL));
+		}
+	}
+	return 0;
+}
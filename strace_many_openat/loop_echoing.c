@@ -1,8 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 int main(int argc, char *argv[])
 {
-    for (;;) {
+	// Loop forever unless given an iteration count
+	long iterations = argc > 1 ? atol(argv[1]) : -1;
+
+	// One write(2) per line even when stdout is not a terminal
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (long i = 0; iterations < 0 || i < iterations; i++) {
 		printf("hello\n");
 	}
     return 0;
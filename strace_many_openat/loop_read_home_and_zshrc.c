@@ -10,10 +10,15 @@ int main(int argc, char *argv[])
 	char buf[1024];
 	ssize_t sz;
 
-	for (;;) {
+	// Loop forever unless given an iteration count
+	long iterations = argc > 1 ? atol(argv[1]) : -1;
+
+	for (long i = 0; iterations < 0 || i < iterations; i++) {
 		int homefd = open(home, O_RDONLY);
 		sz = read(homefd, buf, 1024);
 		int zshrcfd = openat(homefd, ".zshrc", O_RDONLY);
 		sz = read(zshrcfd, buf, 1024);
+		close(zshrcfd);
+		close(homefd);
 	}
 }
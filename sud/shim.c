@@ -0,0 +1,423 @@
+/*
+ * In-process syscall tracing with Syscall User Dispatch (Linux 5.11+).
+ *
+ * Preloaded into the tracee by the sud tracer:
+ *
+ *   gcc -O2 -shared -fPIC -o libsudshim.so shim.c
+ *
+ * The constructor turns on PR_SET_SYSCALL_USER_DISPATCH for the thread,
+ * so every syscall made outside the shim's own `sud_exempt` section raises
+ * SIGSYS instead of entering the kernel. The handler applies the tracer's
+ * policy, runs the syscall itself from the exempt section, stores the
+ * result in the interrupted context and logs an mtrace_record to the
+ * shared ring. No context switch to another process is involved.
+ *
+ * A few syscalls need care because they are made from inside a signal
+ * handler:
+ *
+ *   rt_sigreturn   libc's restorer would trap, so every handler the
+ *                  program installs is given the shim's exempt restorer
+ *   SIGSYS         the program may not block it or replace the handler,
+ *                  since a blocked SIGSYS from dispatch kills the process
+ *   clone/clone3   a thread with a new stack starts in the exempt
+ *                  trampoline, re-arms dispatch for itself and then jumps
+ *                  to the program's code with the interrupted registers
+ *   vfork          runs as fork, so the child cannot scribble over the
+ *                  parent's signal frame
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sud.h"
+
+#ifndef PR_SET_SYSCALL_USER_DISPATCH
+#define PR_SET_SYSCALL_USER_DISPATCH 59
+#define PR_SYS_DISPATCH_OFF 0
+#define PR_SYS_DISPATCH_ON 1
+#endif
+#ifndef SYSCALL_DISPATCH_FILTER_ALLOW
+#define SYSCALL_DISPATCH_FILTER_ALLOW 0
+#define SYSCALL_DISPATCH_FILTER_BLOCK 1
+#endif
+#ifndef SYS_USER_DISPATCH
+#define SYS_USER_DISPATCH 2
+#endif
+
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
+/* Registers saved for a new thread, just below the top of its stack */
+#define CLONE_FRAME_WORDS 15
+
+/* The kernel's struct sigaction, as taken by rt_sigaction */
+struct kernel_sigaction {
+	void *handler;
+	unsigned long flags;
+	void *restorer;
+	uint64_t mask;
+};
+
+long sud_syscall6(long nr, long a0, long a1, long a2, long a3, long a4, long a5);
+long sud_clone_thread(long nr, long a0, long a1, long a2, long a3, long a4, long a5);
+void sud_restore_rt(void);
+__attribute__((visibility("hidden"))) void sud_child_start(void);
+
+extern char __start_sud_exempt[], __stop_sud_exempt[];
+
+/*
+ * Everything in sud_exempt may make syscalls without trapping. The calling
+ * convention of sud_syscall6 is nr, then the six arguments, the last one on
+ * the stack.
+ *
+ * sud_clone_thread is the same call for clones that switch stacks. In the
+ * child, the stack pointer is the clone frame built by the parent: re-arm
+ * dispatch, pop the program's registers and return to the instruction after
+ * its syscall with rax = 0, exactly as a native clone would.
+ */
+__asm__(
+	".pushsection sud_exempt, \"ax\", @progbits\n"
+	".globl sud_syscall6\n"
+	".hidden sud_syscall6\n"
+	".type sud_syscall6, @function\n"
+	"sud_syscall6:\n"
+	"	movq %rdi, %rax\n"
+	"	movq %rsi, %rdi\n"
+	"	movq %rdx, %rsi\n"
+	"	movq %rcx, %rdx\n"
+	"	movq %r8, %r10\n"
+	"	movq %r9, %r8\n"
+	"	movq 8(%rsp), %r9\n"
+	"	syscall\n"
+	"	ret\n"
+	".globl sud_clone_thread\n"
+	".hidden sud_clone_thread\n"
+	".type sud_clone_thread, @function\n"
+	"sud_clone_thread:\n"
+	"	movq %rdi, %rax\n"
+	"	movq %rsi, %rdi\n"
+	"	movq %rdx, %rsi\n"
+	"	movq %rcx, %rdx\n"
+	"	movq %r8, %r10\n"
+	"	movq %r9, %r8\n"
+	"	movq 8(%rsp), %r9\n"
+	"	syscall\n"
+	"	testq %rax, %rax\n"
+	"	jnz 1f\n"
+	"	movq %rsp, %rbx\n"
+	"	andq $-16, %rsp\n"
+	"	call sud_child_start\n"
+	"	movq %rbx, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbp\n"
+	"	popq %rbx\n"
+	"	popq %r11\n"
+	"	popq %r10\n"
+	"	popq %r9\n"
+	"	popq %r8\n"
+	"	popq %rdx\n"
+	"	popq %rsi\n"
+	"	popq %rdi\n"
+	"	popq %rcx\n"
+	"	xorl %eax, %eax\n"
+	"1:\n"
+	"	ret\n"
+	".globl sud_restore_rt\n"
+	".hidden sud_restore_rt\n"
+	".type sud_restore_rt, @function\n"
+	"sud_restore_rt:\n"
+	"	movq $15, %rax\n"
+	"	syscall\n"
+	"	hlt\n"
+	".popsection\n"
+	);
+
+static struct sud_shared *shared;
+
+/* Per-thread dispatch switch, read by the kernel on every syscall */
+static __thread volatile char selector __attribute__((tls_model("initial-exec")));
+static __thread pid_t tid __attribute__((tls_model("initial-exec")));
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int dispatch_on(void)
+{
+	tid = sud_syscall6(SYS_gettid, 0, 0, 0, 0, 0, 0);
+	selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+	return sud_syscall6(SYS_prctl, PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_ON,
+						(long) __start_sud_exempt,
+						__stop_sud_exempt - __start_sud_exempt,
+						(long) &selector, 0);
+}
+
+/*
+ * First code a new thread runs, before any of the program's. It was cloned
+ * from inside the handler, so it starts with SIGSYS blocked.
+ */
+void sud_child_start(void)
+{
+	uint64_t sigsys = 1ULL << (SIGSYS - 1);
+	sud_syscall6(SYS_rt_sigprocmask, SIG_UNBLOCK, (long) &sigsys, 0, sizeof(sigsys), 0, 0);
+	dispatch_on();
+}
+
+static void ring_put(const struct mtrace_record *rec)
+{
+	uint64_t n = atomic_load_explicit(&shared->head, memory_order_relaxed);
+	do {
+		if (n - atomic_load_explicit(&shared->tail, memory_order_acquire) >= shared->capacity) {
+			atomic_fetch_add_explicit(&shared->dropped, 1, memory_order_relaxed);
+			return;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&shared->head, &n, n + 1,
+													memory_order_relaxed,
+													memory_order_relaxed));
+
+	struct sud_slot *slot = &shared->slots[n % shared->capacity];
+	slot->rec = *rec;
+	atomic_store_explicit(&slot->seq, n + 1, memory_order_release);
+}
+
+static void *clone_frame(const greg_t *regs, uint64_t top)
+{
+	uint64_t *f = (uint64_t *) top - CLONE_FRAME_WORDS;
+	// In the order sud_clone_thread pops them, the return address last
+	static const int order[CLONE_FRAME_WORDS] = {
+		REG_R15, REG_R14, REG_R13, REG_R12, REG_RBP, REG_RBX, REG_R11,
+		REG_R10, REG_R9, REG_R8, REG_RDX, REG_RSI, REG_RDI, REG_RCX, REG_RIP,
+	};
+	for (int i = 0; i < CLONE_FRAME_WORDS; i++)
+		f[i] = regs[order[i]];
+	return f;
+}
+
+static long do_clone(long nr, long *args, const greg_t *regs)
+{
+	long ret;
+
+	if (nr == SYS_clone3) {
+		struct clone_args cl = { 0 };
+		size_t size = args[1] < (long) sizeof(cl) ? (size_t) args[1] : sizeof(cl);
+		memcpy(&cl, (void *) args[0], size);
+		if (cl.stack == 0) {
+			cl.flags &= ~(CLONE_VM | CLONE_VFORK);
+			ret = sud_syscall6(nr, (long) &cl, size, 0, 0, 0, 0);
+		} else {
+			clone_frame(regs, cl.stack + cl.stack_size);
+			cl.stack_size -= CLONE_FRAME_WORDS * sizeof(uint64_t);
+			return sud_clone_thread(nr, (long) &cl, size, 0, 0, 0, 0);
+		}
+	} else if (nr == SYS_clone && args[1] != 0) {
+		void *frame = clone_frame(regs, args[1]);
+		return sud_clone_thread(nr, args[0], (long) frame, args[2], args[3], args[4], args[5]);
+	} else if (nr == SYS_clone) {
+		// Without a stack of its own the child must not share our memory
+		ret = sud_syscall6(nr, args[0] & ~(CLONE_VM | CLONE_VFORK), 0,
+						   args[2], args[3], args[4], args[5]);
+	} else {
+		ret = sud_syscall6(SYS_fork, 0, 0, 0, 0, 0, 0);
+	}
+
+	if (ret == 0) {
+		// The child's dispatch is off until it re-arms it; the rest of
+		// this handler still runs as ours
+		dispatch_on();
+		selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+	}
+	return ret;
+}
+
+/* The SIGSYS action the program believes is installed */
+static struct kernel_sigaction program_sigsys;
+
+static long do_sigaction(long *args)
+{
+	// Our SIGSYS handler stays; the program is told its own was installed,
+	// and is handed it back as the old action
+	if (args[0] == SIGSYS) {
+		if (args[3] != sizeof(program_sigsys.mask))
+			return -EINVAL;
+		struct kernel_sigaction old = program_sigsys;
+		if (args[1] != 0)
+			program_sigsys = *(struct kernel_sigaction *) args[1];
+		if (args[2] != 0)
+			*(struct kernel_sigaction *) args[2] = old;
+		return 0;
+	}
+	if (args[1] == 0)
+		return sud_syscall6(SYS_rt_sigaction, args[0], 0, args[2], args[3], 0, 0);
+
+	struct kernel_sigaction act = *(struct kernel_sigaction *) args[1];
+	act.flags |= SA_RESTORER;
+	act.restorer = sud_restore_rt;
+	act.mask &= ~(1ULL << (SIGSYS - 1));
+	return sud_syscall6(SYS_rt_sigaction, args[0], (long) &act, args[2], args[3], 0, 0);
+}
+
+/*
+ * The mask in force when the handler returns is the one saved in the
+ * interrupted context, so that is the one to change.
+ */
+static long do_sigprocmask(long *args, ucontext_t *uc)
+{
+	uint64_t *mask = (uint64_t *) &uc->uc_sigmask;
+	uint64_t old = *mask;
+
+	if (args[1] != 0) {
+		uint64_t set = *(uint64_t *) args[1];
+		switch (args[0]) {
+		case SIG_BLOCK:
+			*mask |= set;
+			break;
+		case SIG_UNBLOCK:
+			*mask &= ~set;
+			break;
+		case SIG_SETMASK:
+			*mask = set;
+			break;
+		default:
+			return -EINVAL;
+		}
+		*mask &= ~(1ULL << (SIGSYS - 1));
+	}
+	if (args[2] != 0)
+		*(uint64_t *) args[2] = old;
+	return 0;
+}
+
+static long run_syscall(long nr, long *args, ucontext_t *uc)
+{
+	const greg_t *regs = uc->uc_mcontext.gregs;
+
+	switch (nr) {
+	case SYS_clone:
+	case SYS_clone3:
+	case SYS_fork:
+	case SYS_vfork:
+		return do_clone(nr, args, regs);
+	case SYS_rt_sigaction:
+		return do_sigaction(args);
+	case SYS_rt_sigprocmask:
+		return do_sigprocmask(args, uc);
+	case SYS_execve:
+	case SYS_execveat:
+		// The new image would otherwise inherit the handler's mask
+		sud_syscall6(SYS_rt_sigprocmask, SIG_SETMASK, (long) &uc->uc_sigmask, 0, 8, 0, 0);
+		return sud_syscall6(nr, args[0], args[1], args[2], args[3], args[4], args[5]);
+	default:
+		return sud_syscall6(nr, args[0], args[1], args[2], args[3], args[4], args[5]);
+	}
+}
+
+static void on_sigsys(int sig, siginfo_t *info, void *ucontext)
+{
+	(void) sig;
+	ucontext_t *uc = ucontext;
+	greg_t *regs = uc->uc_mcontext.gregs;
+	// Syscalls made from here on are ours, not the program's
+	selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+
+	if (info->si_code != SYS_USER_DISPATCH)
+		abort();
+
+	long nr = info->si_syscall;
+	long args[6] = {
+		regs[REG_RDI], regs[REG_RSI], regs[REG_RDX],
+		regs[REG_R10], regs[REG_R8], regs[REG_R9],
+	};
+
+	struct mtrace_record rec = {
+		.tid = tid,
+		.nr = nr,
+		.ts = now_ns(),
+		.rip = regs[REG_RIP],
+		.rbp = regs[REG_RBP],
+	};
+	for (int i = 0; i < 6; i++)
+		rec.args[i] = args[i];
+
+	struct sud_policy *p = (unsigned long) nr < NR_SYSCALLS ? &shared->policy[nr] : NULL;
+	bool record = p == NULL || p->record;
+	if (record && (nr == SYS_exit || nr == SYS_exit_group)) {
+		rec.flags |= MTRACE_REC_NORET;
+		ring_put(&rec);
+		record = false;
+	}
+
+	long ret;
+	uint64_t call = p ? atomic_fetch_add_explicit(&p->calls, 1, memory_order_relaxed) + 1 : 0;
+	if (p != NULL && p->action != SUD_PASS && call % p->every == 0)
+		ret = p->action == SUD_DENY ? -p->value : p->value;
+	else
+		ret = run_syscall(nr, args, uc);
+
+	regs[REG_RAX] = ret;
+	if (record) {
+		rec.ret = ret;
+		ring_put(&rec);
+	}
+	selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+}
+
+__attribute__((constructor))
+static void sud_init(void)
+{
+	const char *env = getenv(SUD_RING_FD_ENV);
+	if (env == NULL)
+		return;
+
+	int fd = atoi(env);
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("sud: ring fd");
+		return;
+	}
+	shared = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED || shared->magic != SUD_MAGIC ||
+		(uint64_t) st.st_size < sud_shared_size(shared->capacity)) {
+		fprintf(stderr, "sud: fd %d is not a sud ring\n", fd);
+		return;
+	}
+
+	struct kernel_sigaction act = {
+		.handler = on_sigsys,
+		.flags = SA_SIGINFO | SA_RESTORER,
+		.restorer = sud_restore_rt,
+	};
+	if (sud_syscall6(SYS_rt_sigaction, SIGSYS, (long) &act, 0, sizeof(act.mask), 0, 0) < 0) {
+		fprintf(stderr, "sud: cannot install the SIGSYS handler\n");
+		return;
+	}
+
+	uint64_t sigsys = 1ULL << (SIGSYS - 1);
+	sud_syscall6(SYS_rt_sigprocmask, SIG_UNBLOCK, (long) &sigsys, 0, sizeof(sigsys), 0, 0);
+
+	long err = dispatch_on();
+	if (err < 0)
+		fprintf(stderr, "sud: PR_SET_SYSCALL_USER_DISPATCH: %s\n", strerror(-err));
+}
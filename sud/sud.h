@@ -0,0 +1,58 @@
+/*
+ * Shared-memory layout between the sud tracer and the preloaded shim.
+ *
+ * The tracer creates the region as a memfd, fills in the per-syscall
+ * policy and passes the fd down in SUD_RING_FD. Every traced thread, in
+ * every traced process, claims ring slots by advancing head; a slot is
+ * published by storing its sequence number, and the tracer consumes slots
+ * in order by advancing tail. A full ring drops records rather than
+ * blocking the tracee.
+ */
+
+#ifndef SUD_H
+#define SUD_H
+
+#include <stdint.h>
+
+#include "../mtrace/record.h"
+#include "../mtrace/syscallent.h"
+
+#define SUD_MAGIC 0x474e495244555353ULL /* "SSUDRING" */
+#define SUD_RING_FD_ENV "SUD_RING_FD"
+
+enum sud_action {
+	SUD_PASS,	// execute the syscall
+	SUD_DENY,	// fail it with -value, without executing it
+	SUD_INJECT,	// return value, without executing it
+};
+
+struct sud_policy {
+	uint8_t record;
+	uint8_t action;
+	// Deny or inject only every `every`-th call
+	uint32_t every;
+	uint64_t calls;
+	int64_t value;
+};
+
+struct sud_slot {
+	uint64_t seq;		// n + 1 once record number n is in the slot
+	struct mtrace_record rec;
+};
+
+struct sud_shared {
+	uint64_t magic;
+	uint64_t capacity;	// in slots
+	uint64_t head;		// records claimed by writers
+	uint64_t tail;		// records consumed by the tracer
+	uint64_t dropped;
+	struct sud_policy policy[NR_SYSCALLS];
+	struct sud_slot slots[];
+};
+
+static inline uint64_t sud_shared_size(uint64_t capacity)
+{
+	return sizeof(struct sud_shared) + capacity * sizeof(struct sud_slot);
+}
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * Syscall tracer without ptrace: the tracee is started with libsudshim.so
+ * preloaded, traps its own syscalls through Syscall User Dispatch and
+ * writes them to a shared ring that this process prints in mtrace's text
+ * format.
+ *
+ *   gcc -O2 -o sudtrace tracer.c
+ *   gcc -O2 -shared -fPIC -o libsudshim.so shim.c
+ *
+ * Policies run inside the tracee, in the SIGSYS handler: -d fails a
+ * syscall with an errno without running it and -i makes it return a fixed
+ * value, either on every call or on every Nth. Statically linked programs
+ * and syscalls made before the shim's constructor are not seen.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sud.h"
+
+#define DEFAULT_SLOTS 65536
+#define SHIM_NAME "libsudshim.so"
+
+/* How long the reader sleeps on an empty ring */
+#define POLL_NS 200000
+
+static struct sud_shared *shared;
+
+void usage() {
+	printf(
+		"sudtrace [-e trace=SYSCALL[,SYSCALL...]] [-d SYSCALL[:ERRNO][/N]]...\n"
+		"         [-i SYSCALL:VALUE[/N]]... [-b SLOTS] [-L SHIM] <program> [args...]\n"
+		);
+}
+
+static int syscall_lookup(const char *name)
+{
+	char *end;
+	long nr = strtol(name, &end, 0);
+	if (*name != '\0' && *end == '\0')
+		return (nr >= 0 && nr < (long) NR_SYSCALLS) ? (int) nr : -1;
+
+	for (size_t i = 0; i < NR_SYSCALLS; i++) {
+		if (syscallent[i] && strcmp(syscallent[i], name) == 0)
+			return (int) i;
+	}
+	return -1;
+}
+
+static int errno_lookup(const char *name)
+{
+	char *end;
+	long e = strtol(name, &end, 0);
+	if (*name != '\0' && *end == '\0')
+		return e > 0 ? (int) e : -1;
+
+	for (int i = 1; i < 4096; i++) {
+		const char *s = strerrorname_np(i);
+		if (s && strcmp(s, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int parse_trace_expr(const char *expr)
+{
+	const char *prefix = "trace=";
+	if (strncmp(expr, prefix, strlen(prefix)) != 0) {
+		fprintf(stderr, "invalid expression: %s\n", expr);
+		return -1;
+	}
+
+	char *list = strdup(expr + strlen(prefix));
+	if (list == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	for (size_t i = 0; i < NR_SYSCALLS; i++)
+		shared->policy[i].record = 0;
+
+	char *saveptr;
+	for (char *name = strtok_r(list, ",", &saveptr); name;
+		 name = strtok_r(NULL, ",", &saveptr)) {
+		int nr = syscall_lookup(name);
+		if (nr == -1) {
+			fprintf(stderr, "unknown syscall: %s\n", name);
+			free(list);
+			return -1;
+		}
+		shared->policy[nr].record = 1;
+	}
+	free(list);
+	return 0;
+}
+
+/*
+ * -d SYSCALL[:ERRNO][/N] and -i SYSCALL:VALUE[/N]. Without an errno, a
+ * denied syscall fails with EPERM.
+ */
+static int parse_policy(enum sud_action action, const char *spec)
+{
+	char *s = strdup(spec);
+	if (s == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	uint32_t every = 1;
+	char *slash = strchr(s, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+		every = strtoul(slash + 1, NULL, 0);
+	}
+
+	// Any value can be injected, -1 too: whether it was given is kept apart
+	int64_t value = EPERM;
+	bool valid = true;
+	char *colon = strchr(s, ':');
+	if (colon != NULL) {
+		*colon = '\0';
+		if (action == SUD_DENY) {
+			value = errno_lookup(colon + 1);
+			valid = value != -1;
+		} else {
+			char *end;
+			errno = 0;
+			value = strtoll(colon + 1, &end, 0);
+			valid = end != colon + 1 && *end == '\0' && errno == 0;
+		}
+	} else if (action == SUD_INJECT) {
+		valid = false;
+	}
+
+	int nr = syscall_lookup(s);
+	if (nr == -1 || every == 0 || !valid) {
+		fprintf(stderr, "invalid policy: %s\n", spec);
+		free(s);
+		return -1;
+	}
+	free(s);
+
+	shared->policy[nr].action = action;
+	shared->policy[nr].value = value;
+	shared->policy[nr].every = every;
+	return 0;
+}
+
+static struct sud_shared *shared_create(uint64_t capacity, int *fdp)
+{
+	int fd = memfd_create("sud-ring", 0);
+	if (fd == -1) {
+		perror("memfd_create");
+		return NULL;
+	}
+
+	uint64_t size = sud_shared_size(capacity);
+	if (ftruncate(fd, size) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+
+	struct sud_shared *s = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (s == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return NULL;
+	}
+
+	s->magic = SUD_MAGIC;
+	s->capacity = capacity;
+	for (size_t i = 0; i < NR_SYSCALLS; i++) {
+		s->policy[i].record = 1;
+		s->policy[i].every = 1;
+	}
+	*fdp = fd;
+	return s;
+}
+
+/* The shim is looked for next to this binary unless -L names it */
+static char *default_shim(void)
+{
+	static char path[PATH_MAX];
+	char self[PATH_MAX];
+	ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (n == -1)
+		return SHIM_NAME;
+	self[n] = '\0';
+	snprintf(path, sizeof(path), "%s/%s", dirname(self), SHIM_NAME);
+	return path;
+}
+
+/* Prepend the shim to any LD_PRELOAD the program already has */
+static void set_preload(const char *shim)
+{
+	const char *old = getenv("LD_PRELOAD");
+	char *preload;
+	if (old != NULL && *old != '\0') {
+		if (asprintf(&preload, "%s:%s", shim, old) == -1)
+			preload = NULL;
+	} else {
+		preload = strdup(shim);
+	}
+	if (preload == NULL || setenv("LD_PRELOAD", preload, 1) == -1) {
+		perror("setenv");
+		_exit(1);
+	}
+	free(preload);
+}
+
+/* Print the records that are ready, in order. Returns how many there were */
+static uint64_t drain(pid_t root)
+{
+	uint64_t tail = atomic_load_explicit(&shared->tail, memory_order_relaxed);
+	uint64_t n;
+	for (n = 0;; n++, tail++) {
+		struct sud_slot *slot = &shared->slots[tail % shared->capacity];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != tail + 1)
+			break;
+
+		struct mtrace_record rec = slot->rec;
+		atomic_store_explicit(&shared->tail, tail + 1, memory_order_release);
+
+		if (rec.tid != (uint32_t) root)
+			fprintf(stderr, "[%u] ", rec.tid);
+		mtrace_print_entry(stderr, &rec);
+		if (rec.tid != (uint32_t) root)
+			fprintf(stderr, "[%u]", rec.tid);
+		mtrace_print_exit(stderr, &rec);
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t capacity = DEFAULT_SLOTS;
+	const char *shim = NULL;
+	const char *trace_expr = NULL;
+	int fd;
+
+	int opt;
+	// Policies are parsed into the shared region, so size it first
+	while ((opt = getopt(argc, argv, "+e:d:i:b:L:")) != -1) {
+		if (opt == 'b')
+			capacity = strtoull(optarg, NULL, 0);
+		else if (opt == '?') {
+			usage();
+			exit(1);
+		}
+	}
+	if (optind >= argc || capacity == 0) {
+		usage();
+		exit(1);
+	}
+
+	shared = shared_create(capacity, &fd);
+	if (shared == NULL)
+		exit(1);
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, "+e:d:i:b:L:")) != -1) {
+		switch (opt) {
+		case 'e':
+			trace_expr = optarg;
+			break;
+		case 'd':
+			if (parse_policy(SUD_DENY, optarg) == -1)
+				exit(1);
+			break;
+		case 'i':
+			if (parse_policy(SUD_INJECT, optarg) == -1)
+				exit(1);
+			break;
+		case 'L':
+			shim = optarg;
+			break;
+		}
+	}
+	if (trace_expr != NULL && parse_trace_expr(trace_expr) == -1)
+		exit(1);
+	if (shim == NULL)
+		shim = default_shim();
+	if (access(shim, R_OK) == -1) {
+		fprintf(stderr, "%s: %s\n", shim, strerror(errno));
+		exit(1);
+	}
+
+	pid_t cpid = fork();
+	if (cpid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cpid == 0) {
+		// Child
+		char fdstr[16];
+		snprintf(fdstr, sizeof(fdstr), "%d", fd);
+		setenv(SUD_RING_FD_ENV, fdstr, 1);
+		set_preload(shim);
+		execvp(argv[optind], &argv[optind]);
+		perror("execvp");
+		_exit(127);
+	}
+	close(fd);
+
+	// The tracee keeps running while we print, so the reader just polls
+	int status;
+	for (;;) {
+		if (drain(cpid) > 0)
+			continue;
+
+		pid_t w = waitpid(cpid, &status, WNOHANG);
+		if (w == -1) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+		if (w == cpid) {
+			drain(cpid);
+			break;
+		}
+		struct timespec ts = { 0, POLL_NS };
+		nanosleep(&ts, NULL);
+	}
+
+	uint64_t dropped = atomic_load(&shared->dropped);
+	if (dropped > 0)
+		fprintf(stderr, "sudtrace: %llu records dropped, the ring was full (-b)\n",
+				(unsigned long long) dropped);
+
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "+++ killed by %s +++\n", strsignal(WTERMSIG(status)));
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,258 @@
+// Cost of tracing an openat() loop, per openat():
+//
+//   untraced     the tracee alone
+//   no_hooks     traced, with an empty seccomp filter: no stops
+//   miss         the openat-to-socket+connect script of main.rs, whose
+//                activation reads the path and never matches it
+//   match_step   the same script, always matching, each Call stepped
+//   match_batch  the same, the Calls run from the trampoline
+//   match_pool   always matching, a pooled connection Installed in place
+//                of the openat() instead of the socket() and connect()
+//
+//   cargo bench --bench hooks
+//
+// The tracee, benches/openat_loop.c, is built with cc. After each setup
+// the latency distribution of a single openat() is printed, as measured
+// inside the tracee.
+
+use sysjack::common::SockaddrUn;
+use sysjack::ctrl::{Val, SkipControl, ScriptStarter, Predicate,
+					FailControl, CallControl, Script};
+use sysjack::trace::{Tracee, Tracer, ExecMode};
+use sysjack::pool::SocketPool;
+use sysjack::regs::{Register, Reg, StringReader};
+use sysjack::util::{struct2words, Words};
+
+use criterion::{criterion_group, criterion_main, Criterion};
+use nc::{SYS_OPENAT, SYS_SOCKET, SYS_CONNECT, AF_UNIX, SOCK_STREAM};
+use nix::unistd::{pipe, close};
+use std::cell::RefCell;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{Read, Write};
+use std::os::unix::io::FromRawFd;
+use std::os::unix::net::UnixListener;
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command};
+use std::sync::mpsc;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+static WRITER_OUTPUT: &str = "/tmp/writer_output";
+static SOCKET_PATH: &str = "/tmp/portalsock";
+static MISS_PATH: &str = "/dev/null";
+
+// openat() calls behind each printed distribution
+const DISTRIBUTION_CALLS: u64 = 20000;
+
+// Connections of the match_pool setup's pool
+const POOL_SIZE: usize = 64;
+
+#[derive(Clone, Copy)]
+enum Setup {
+	Untraced,
+	NoHooks,
+	Miss,
+	Match(ExecMode),
+	Pool,
+}
+
+fn build_tracee() -> PathBuf {
+	let src = Path::new(env!("CARGO_MANIFEST_DIR")).join("benches/openat_loop.c");
+	let out = std::env::temp_dir().join("sysjack-openat-loop");
+	let status = Command::new("cc")
+		.args(&["-O2", "-o"])
+		.arg(&out)
+		.arg(&src)
+		.status()
+		.expect("cc");
+	assert!(status.success(), "building {:?}", src);
+	out
+}
+
+// The script of main.rs
+fn openat_script<'a>(activation: &'a dyn Fn(Reg, Reg, Reg, Reg) -> bool)
+					 -> Script<&'a dyn Fn(Reg, Reg, Reg, Reg) -> bool> {
+	let starter = ScriptStarter::new(activation, SkipControl::Skip {
+		regs_enter_name: "openat_regs_enter".to_owned()
+	});
+	let blob = struct2words(SockaddrUn::new(AF_UNIX.try_into().unwrap(), SOCKET_PATH));
+	let bloblen = Words::<SockaddrUn>::LEN;
+
+	let mut builder = Script::builder();
+	builder.new(starter, FailControl::Default)
+		.when(Predicate::int_eq(0, nc::AT_FDCWD as i32))
+		.call(CallControl::new("socket_regs_enter".to_owned(),
+							   "socket_regs_exit".to_owned(),
+							   "socket_ret".to_owned()),
+			  SYS_SOCKET,
+			  vec![Val::Raw(AF_UNIX as Reg),
+				   Val::Raw(SOCK_STREAM as Reg),
+				   Val::Raw(0)])
+		.alloc(blob, "serveraddr".to_owned())
+		.call(CallControl::new("connect_regs_enter".to_owned(),
+							   "connect_exit".to_owned(),
+							   "connect_ret".to_owned()),
+			  SYS_CONNECT,
+			  vec![Val::Var("socket_ret".to_owned()),
+				   Val::Var("serveraddr".to_owned()),
+				   Val::Raw(bloblen as Reg)])
+		.ret(Val::Var("socket_ret".to_owned()));
+	builder.build().unwrap()
+}
+
+// The script of main.rs --pool
+fn pool_script<'a>(activation: &'a dyn Fn(Reg, Reg, Reg, Reg) -> bool)
+				   -> Script<&'a dyn Fn(Reg, Reg, Reg, Reg) -> bool> {
+	let starter = ScriptStarter::new(activation, SkipControl::Skip {
+		regs_enter_name: "openat_regs_enter".to_owned()
+	});
+	let mut builder = Script::builder();
+	builder.new(starter, FailControl::Default)
+		.when(Predicate::int_eq(0, nc::AT_FDCWD as i32))
+		.install("socket_ret".to_owned())
+		.ret(Val::Var("socket_ret".to_owned()));
+	builder.build().unwrap()
+}
+
+// The tracee runs the openat() loop on request, under its setup
+struct Worker {
+	req: File,
+	ack: File,
+	child: Option<Child>,
+	tracer: Option<JoinHandle<()>>,
+}
+
+impl Worker {
+	fn start(prog: &Path, setup: Setup) -> Self {
+		let (req_rx, req_tx) = pipe().unwrap();
+		let (ack_rx, ack_tx) = pipe().unwrap();
+		let path = match setup {
+			Setup::Match(_) | Setup::Pool => WRITER_OUTPUT,
+			_ => MISS_PATH,
+		};
+		let args = vec![req_rx.to_string(), ack_tx.to_string(), path.to_owned()];
+
+		let mut worker = Worker {
+			req: unsafe { File::from_raw_fd(req_tx) },
+			ack: unsafe { File::from_raw_fd(ack_rx) },
+			child: None,
+			tracer: None,
+		};
+		match setup {
+			Setup::Untraced => {
+				worker.child = Some(Command::new(prog).args(&args).spawn().unwrap());
+			}
+			_ => {
+				let (started_tx, started_rx) = mpsc::channel();
+				let prog = prog.to_owned();
+				// The tracer thread forks the tracee, which makes it its ptracer
+				worker.tracer = Some(thread::spawn(move || {
+					let tracee = Tracee::spawn_with_args(&prog, &args).unwrap();
+					started_tx.send(()).unwrap();
+					trace(&tracee, setup);
+				}));
+				started_rx.recv().unwrap();
+			}
+		}
+		// Only the tracee writes acks: reads fail once it is gone
+		close(req_rx).unwrap();
+		close(ack_tx).unwrap();
+		worker
+	}
+
+	// Runs count openat() calls. Returns the count, then the min, median,
+	// 90th, 99th percentile and max latency in ns.
+	fn run(&mut self, count: u64) -> [u64; 6] {
+		self.req.write_all(&count.to_ne_bytes()).unwrap();
+		let mut reply = [0u8; 48];
+		self.ack.read_exact(&mut reply).unwrap();
+		let mut stats = [0u64; 6];
+		for (stat, bytes) in stats.iter_mut().zip(reply.chunks(8)) {
+			*stat = u64::from_ne_bytes(bytes.try_into().unwrap());
+		}
+		stats
+	}
+}
+
+impl Drop for Worker {
+	fn drop(&mut self) {
+		self.req.write_all(&0u64.to_ne_bytes()).ok();
+		if let Some(mut child) = self.child.take() {
+			child.wait().ok();
+		}
+		if let Some(tracer) = self.tracer.take() {
+			tracer.join().ok();
+		}
+	}
+}
+
+fn trace(tracee: &Tracee, setup: Setup) {
+	let pid = tracee.pid();
+	let path_reader = RefCell::new(StringReader::new(libc::PATH_MAX as usize));
+	let openat_activation = |_dirfd: Reg, pathname: Reg, _flags: Reg, _mode: Reg| {
+		pathname.resolve_string(pid, &mut path_reader.borrow_mut())
+			.map_or(false, |path| path == WRITER_OUTPUT.as_bytes())
+	};
+
+	let mut tracer = Tracer::<&dyn Fn(Reg, Reg, Reg, Reg) -> bool>::new(tracee);
+	match setup {
+		Setup::Untraced | Setup::NoHooks => {}
+		Setup::Miss => {
+			tracer.hook(SYS_OPENAT, openat_script(&openat_activation)).unwrap();
+		}
+		Setup::Match(mode) => {
+			tracer.set_mode(mode);
+			tracer.hook(SYS_OPENAT, openat_script(&openat_activation)).unwrap();
+		}
+		Setup::Pool => {
+			tracer.set_pool(SocketPool::new(Path::new(SOCKET_PATH), POOL_SIZE).unwrap());
+			tracer.hook(SYS_OPENAT, pool_script(&openat_activation)).unwrap();
+		}
+	}
+	tracer.sync().unwrap();
+}
+
+fn bench_setup(c: &mut Criterion, prog: &Path, name: &str, setup: Setup) {
+	let mut worker = Worker::start(prog, setup);
+	let mut group = c.benchmark_group("openat");
+	group.bench_function(name, |b| {
+		b.iter_custom(|iters| {
+			let start = Instant::now();
+			worker.run(iters);
+			start.elapsed()
+		})
+	});
+	group.finish();
+
+	let [count, min, p50, p90, p99, max] = worker.run(DISTRIBUTION_CALLS);
+	println!("openat/{}: {} calls, ns min {} p50 {} p90 {} p99 {} max {}",
+			 name, count, min, p50, p90, p99, max);
+}
+
+fn hooks(c: &mut Criterion) {
+	let prog = build_tracee();
+
+	// connect() of the matching script succeeds; the connections are dropped
+	std::fs::remove_file(SOCKET_PATH).ok();
+	let listener = UnixListener::bind(SOCKET_PATH).unwrap();
+	thread::spawn(move || {
+		for conn in listener.incoming() {
+			drop(conn);
+		}
+	});
+
+	bench_setup(c, &prog, "untraced", Setup::Untraced);
+	bench_setup(c, &prog, "no_hooks", Setup::NoHooks);
+	bench_setup(c, &prog, "miss", Setup::Miss);
+	bench_setup(c, &prog, "match_step", Setup::Match(ExecMode::Step));
+	bench_setup(c, &prog, "match_batch", Setup::Match(ExecMode::Batch));
+	bench_setup(c, &prog, "match_pool", Setup::Pool);
+}
+
+criterion_group! {
+	name = benches;
+	config = Criterion::default().measurement_time(Duration::from_secs(5));
+	targets = hooks
+}
+criterion_main!(benches);
@@ -0,0 +1,90 @@
+/*
+ * Tracee of the hooks benchmark:
+ *
+ *   openat_loop REQ_FD ACK_FD PATH
+ *
+ * Reads an iteration count from REQ_FD, then runs openat(AT_FDCWD, PATH)
+ * and close() on the result that many times, timing each openat() with
+ * the vDSO clock so that the timing itself never stops under the tracer.
+ * Replies on ACK_FD with the count and the min, median, 90th and 99th
+ * percentile and max latency in ns. A count of 0 ends it.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdio.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	for (size_t done = 0; done < len;) {
+		ssize_t n = read(fd, (char *) buf + done, len - done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4) {
+		fprintf(stderr, "openat_loop REQ_FD ACK_FD PATH\n");
+		return 1;
+	}
+	int req = atoi(argv[1]);
+	int ack = atoi(argv[2]);
+	const char *path = argv[3];
+
+	uint64_t *lat = NULL;
+	uint64_t cap = 0;
+	uint64_t count;
+	while (read_full(req, &count, sizeof(count)) == 0 && count > 0) {
+		if (count > cap) {
+			free(lat);
+			lat = malloc(count * sizeof(*lat));
+			if (lat == NULL) {
+				perror("malloc");
+				return 1;
+			}
+			cap = count;
+		}
+
+		for (uint64_t i = 0; i < count; i++) {
+			uint64_t start = now_ns();
+			int fd = openat(AT_FDCWD, path, O_RDONLY);
+			lat[i] = now_ns() - start;
+			if (fd >= 0)
+				close(fd);
+		}
+
+		qsort(lat, count, sizeof(*lat), cmp_u64);
+		uint64_t reply[6] = {
+			count,
+			lat[0],
+			lat[count / 2],
+			lat[count * 9 / 10],
+			lat[count * 99 / 100],
+			lat[count - 1],
+		};
+		if (write(ack, reply, sizeof(reply)) != sizeof(reply)) {
+			perror("write");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+// Time taken to copy an Instruction::Alloc blob into a stopped tracee,
+// by blob size and write path:
+//
+//   cargo run --release --example alloc_latency [iterations]
+
+use sysjack::mem::{MemWriter, WritePath};
+use sysjack::regs::{Word, Reg, WORD_SIZE};
+
+use nix::sys::ptrace;
+use nix::sys::signal::{kill, raise, Signal};
+use nix::sys::wait::waitpid;
+use nix::unistd::{fork, pause, ForkResult};
+use std::{cmp, env, time::Instant};
+
+const MIN_BLOB: usize = 16;
+const MAX_BLOB: usize = 64 * 1024;
+
+fn main() {
+	let iterations: usize = env::args().nth(1)
+		.map(|s| s.parse().expect("iterations"))
+		.unwrap_or(2000);
+
+	// The child inherits this buffer at the same address
+	let target = vec![0 as Word; MAX_BLOB / WORD_SIZE];
+	let addr = target.as_ptr() as Reg;
+
+	match fork() {
+		Ok(ForkResult::Child) => {
+			ptrace::traceme().unwrap();
+			raise(Signal::SIGSTOP).unwrap();
+			loop {
+				pause();
+			}
+		}
+		Ok(ForkResult::Parent { child, .. }) => {
+			waitpid(child, None).unwrap();
+
+			println!("{:>8} {:>14} {:>14} {:>14}", "bytes", "vm_writev ns", "proc_mem ns", "pokedata ns");
+			let mut size = MIN_BLOB;
+			while size <= MAX_BLOB {
+				let blob: Vec<Word> = (0..size / WORD_SIZE).map(|i| i as Word).collect();
+				print!("{:>8}", size);
+				for path in &[WritePath::VmWritev, WritePath::ProcMem, WritePath::PokeData] {
+					let mut writer = MemWriter::with_path(child, *path);
+					// A word per syscall: keep the large POKEDATA runs short
+					let n = match path {
+						WritePath::PokeData => cmp::max(10, iterations * MIN_BLOB / size),
+						_ => iterations,
+					};
+
+					let start = Instant::now();
+					for _ in 0..n {
+						writer.write_words(addr, &blob).unwrap();
+					}
+					let ns = start.elapsed().as_nanos() / n as u128;
+					if writer.path() == *path {
+						print!(" {:>14}", ns);
+					} else {
+						print!(" {:>14}", "denied");
+					}
+				}
+				println!();
+				size *= 2;
+			}
+
+			kill(child, Signal::SIGKILL).unwrap();
+			waitpid(child, None).ok();
+		}
+		Err(e) => {
+			eprintln!("fork(): {}", e);
+			std::process::exit(1);
+		}
+	}
+}
@@ -0,0 +1,78 @@
+// Cost of a hook whose script has three Calls and an Alloc, by how the
+// script starts and how its Calls run:
+//
+//   cargo run --release --example getppid_hook [hooks]
+//
+// getppid() is answered with getsid(kill(getpid(), 0)), which is
+// getsid(0), the kill() taking the result of the getpid(). The tracee,
+// examples/getppid_loop.c, is built with cc. It calls getppid() that
+// many times and prints the time per call, hook included.
+
+use sysjack::ctrl::{Val, SkipControl, ScriptStarter, FailControl, CallControl, Script};
+use sysjack::trace::{Tracee, Tracer, ExecMode};
+use sysjack::regs::Reg;
+
+use nc::{SYS_GETPPID, SYS_GETPID, SYS_KILL, SYS_GETSID};
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+use std::env;
+
+fn build_tracee() -> PathBuf {
+	let src = Path::new(env!("CARGO_MANIFEST_DIR")).join("examples/getppid_loop.c");
+	let out = env::temp_dir().join("sysjack-getppid-loop");
+	let status = Command::new("cc")
+		.args(&["-O2", "-o"])
+		.arg(&out)
+		.arg(&src)
+		.status()
+		.expect("cc");
+	assert!(status.success(), "building {:?}", src);
+	out
+}
+
+fn call_ctrl(name: &str) -> CallControl {
+	CallControl::new(format!("{}_regs_enter", name), format!("{}_regs_exit", name), name.to_owned())
+}
+
+fn script<'a>(activation: &'a dyn Fn(Reg) -> bool, keep: bool) -> Script<&'a dyn Fn(Reg) -> bool> {
+	let skip_ctrl = if keep {
+		SkipControl::Keep {
+			regs_enter_name: "getppid_regs_enter".to_owned(),
+			regs_exit_name: "getppid_regs_exit".to_owned(),
+			ret_name: "getppid_ret".to_owned(),
+		}
+	} else {
+		SkipControl::Skip {
+			regs_enter_name: "getppid_regs_enter".to_owned()
+		}
+	};
+	let mut builder = Script::builder();
+	builder.new(ScriptStarter::new(activation, skip_ctrl), FailControl::Default)
+		.call(call_ctrl("pid"), SYS_GETPID, vec![])
+		// Copied into the tracee each time, never read
+		.alloc(vec![0x0a6b6f, 0], "blob".to_owned())
+		.call(call_ctrl("kill"), SYS_KILL, vec![Val::Var("pid".to_owned()), Val::Raw(0)])
+		.call(call_ctrl("sid"), SYS_GETSID, vec![Val::Var("kill".to_owned())])
+		.ret(Val::Var("sid".to_owned()));
+	builder.build().unwrap()
+}
+
+fn main() {
+	let hooks = env::args().nth(1).unwrap_or_else(|| "2000".to_owned());
+	let prog = build_tracee();
+
+	for &keep in &[false, true] {
+		for &mode in &[ExecMode::Step, ExecMode::Batch] {
+			print!("{:<5} {:<6} ", if keep { "Keep" } else { "Skip" }, format!("{:?}", mode));
+			std::io::stdout().flush().unwrap();
+
+			let tracee = Tracee::spawn_with_args(&prog, &[hooks.clone()]).unwrap();
+			let activation = |_: Reg| true;
+			let mut tracer = Tracer::new(&tracee);
+			tracer.set_mode(mode);
+			tracer.hook(SYS_GETPPID, script(&activation, keep)).unwrap();
+			tracer.sync().unwrap();
+		}
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * Tracee of the getppid_hook example:
+ *
+ *   getppid_loop HOOKS
+ *
+ * Calls getppid() HOOKS times and checks each answer against getsid(0),
+ * which is what the example's script returns. Prints how many matched and
+ * the time per getppid() in us.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "getppid_loop HOOKS\n");
+		return 1;
+	}
+	int hooks = atoi(argv[1]);
+	pid_t sid = getsid(0);
+
+	struct timespec start, end;
+	int ok = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < hooks; i++)
+		ok += syscall(SYS_getppid) == sid;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double us = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3;
+	printf("%d/%d ok, %.1f us/hook\n", ok, hooks, hooks > 0 ? us / hooks : 0);
+	return 0;
+}
@@ -0,0 +1,311 @@
+extern crate nc;
+
+use std::cell::{Cell, RefCell};
+use std::future::Future;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::path::Path;
+use std::pin::Pin;
+use std::rc::Rc;
+use nix::unistd::Pid;
+use nix::errno::Errno;
+use nix::sys::wait::{waitpid, WaitPidFlag, WaitStatus};
+use tokio::io::unix::AsyncFd;
+use tokio::signal::unix::{signal, Signal, SignalKind};
+use tokio::task::LocalSet;
+use crate::ctrl::Predicate;
+use crate::regs::{Word, Reg, StringReader, NR_SYSCALLS};
+use crate::task::{Task, Tasks, TaskStop, Step};
+use crate::seccomp::Filter;
+use crate::trace::Tracee;
+
+type AsyncError = String;
+
+// What a hook resolves to: an error stops the tracer
+pub type HookFuture = Pin<Box<dyn Future<Output = Result<(), AsyncError>>>>;
+
+type AsyncHook = Rc<dyn Fn(Stop) -> HookFuture>;
+
+// Runs fut, and the tracers it spawns with tokio::task::spawn_local(), on
+// a single-threaded runtime in the calling thread. Tracees are forked by
+// the thread that runs their tracer, which must stay their ptracer: a
+// multi-threaded runtime could move a tracer to another thread.
+pub fn block_on_local<F: Future>(fut: F) -> F::Output {
+	let rt = tokio::runtime::Builder::new_current_thread()
+		.enable_all()
+		.build()
+		.unwrap();
+	LocalSet::new().block_on(&rt, fut)
+}
+
+// A pidfd, registered with the reactor
+struct PidFd(RawFd);
+
+impl AsRawFd for PidFd {
+	fn as_raw_fd(&self) -> RawFd {
+		self.0
+	}
+}
+
+impl Drop for PidFd {
+	fn drop(&mut self) {
+		unsafe { libc::close(self.0) };
+	}
+}
+
+// The tracee and the state of its current stop, shared by the tracer and
+// the Stop of a running hook. Borrows of its cells never last across an
+// await, but for the one of sigchld in wait(): only one future at a time
+// waits, the tracer's or that of the keep() or inject() under way.
+struct Shared {
+	// Readable once the tracee has exited. A pidfd says nothing about
+	// ptrace stops, which the tracer learns of through SIGCHLD.
+	pidfd: AsyncFd<PidFd>,
+	sigchld: RefCell<Signal>,
+	// A keep() or inject() is under way: the task runs meanwhile
+	busy: Cell<bool>,
+	// The task whose stop is being handled, and the others
+	task: RefCell<Task>,
+	tasks: RefCell<Tasks>,
+	// The hooked syscall, as the stop showed it
+	syscall: Cell<(nc::sysno::Sysno, [Reg; 6])>,
+	strings: RefCell<StringReader>,
+}
+
+impl Shared {
+	fn pid(&self) -> Pid {
+		self.task.borrow().pid
+	}
+
+	// Waits for the next status of one of pids without blocking the
+	// thread. Other tracers of the thread wait for their own tasks, so
+	// each is asked for by its pid. SIGCHLD is subscribed to before the
+	// first check, so a stop between the check and the wait is not
+	// missed.
+	async fn wait(&self, pids: &[Pid]) -> Result<WaitStatus, AsyncError> {
+		loop {
+			for &pid in pids {
+				match waitpid(pid, Some(WaitPidFlag::WNOHANG | WaitPidFlag::__WALL)) {
+					// ECHILD: a thread whose tid an execve() took over,
+					// before the exec event says so
+					Ok(WaitStatus::StillAlive) | Err(nix::Error::Sys(Errno::ECHILD)) => {}
+					Ok(status) => return Ok(status),
+					Err(e) => return Err(format!("waitpid({}): {}", pid, e)),
+				}
+			}
+			let mut sigchld = self.sigchld.borrow_mut();
+			tokio::select! {
+				_ = sigchld.recv() => {}
+				ready = self.pidfd.readable() => {
+					// Reaped by the next waitpid()
+					ready.map_err(|e| format!("pidfd: {}", e))?.retain_ready();
+				}
+			}
+		}
+	}
+
+	// Held by the keep() or inject() under way, so that a second one,
+	// from a clone of its Stop, fails rather than step the task too
+	fn busy(&self) -> Result<Busy<'_>, AsyncError> {
+		if self.busy.replace(true) {
+			return Err(format!("{}: a keep() or inject() is under way", self.pid()));
+		}
+		Ok(Busy(&self.busy))
+	}
+
+	// Task::step() for a reactor: the current task is waited for alone
+	async fn step(&self, how: Step) -> Result<(), AsyncError> {
+		let pid = self.pid();
+		loop {
+			self.task.borrow_mut().step(how)?;
+			let status = self.wait(&[pid]).await?;
+			if self.task.borrow_mut().stepped(how, status)? {
+				return Ok(());
+			}
+		}
+	}
+}
+
+struct Busy<'a>(&'a Cell<bool>);
+
+impl Drop for Busy<'_> {
+	fn drop(&mut self) {
+		self.0.set(false);
+	}
+}
+
+// The tracee, stopped at a hooked syscall, as a hook sees it. The tracee
+// resumes when the hook's future completes.
+#[derive(Clone)]
+pub struct Stop(Rc<Shared>);
+
+impl Stop {
+	// Of the thread or process that made the syscall
+	pub fn pid(&self) -> Pid {
+		self.0.pid()
+	}
+
+	pub fn sysno(&self) -> nc::sysno::Sysno {
+		self.0.syscall.get().0
+	}
+
+	pub fn args(&self) -> [Reg; 6] {
+		self.0.syscall.get().1
+	}
+
+	// The NUL-terminated string at addr, without its NUL
+	pub fn read_string(&self, addr: Reg) -> Result<Vec<u8>, AsyncError> {
+		self.0.strings.borrow_mut().read(self.pid(), addr).map(|s| s.to_vec())
+	}
+
+	pub fn write_words(&self, addr: Reg, words: &[Word]) -> Result<(), AsyncError> {
+		self.0.task.borrow_mut().mem.write_words(addr, words)
+	}
+
+	// Runs the hooked syscall itself. Returns what it returned.
+	pub async fn keep(&self) -> Result<Reg, AsyncError> {
+		let _busy = self.0.busy()?;
+		if !self.0.task.borrow().at_entry {
+			return Err("the hooked syscall already ran".to_owned());
+		}
+		self.0.step(Step::Syscall).await?;
+		self.0.task.borrow_mut().cache.ret()
+	}
+
+	// Runs a syscall of our own, as a Tracer script's Call does in Step
+	// mode. Before the hooked syscall has run, in place of it; after, by
+	// backing up to the syscall instruction.
+	pub async fn inject(&self, sysno: nc::sysno::Sysno, args: &[Reg]) -> Result<Reg, AsyncError> {
+		let _busy = self.0.busy()?;
+		self.0.task.borrow_mut().inject(sysno, args)?;
+		self.0.step(Step::Over).await?;
+		self.0.task.borrow_mut().cache.ret()
+	}
+
+	// What the hooked syscall returns. Set before the syscall has run, it
+	// is skipped.
+	pub fn set_ret(&self, ret: Reg) -> Result<(), AsyncError> {
+		let _busy = self.0.busy()?;
+		let mut task = self.0.task.borrow_mut();
+		let mut regs = task.cache.regs()?.clone();
+		regs.set_ret(&ret);
+		if task.at_entry {
+			regs.no_syscall();
+		}
+		// Written back as the task resumes
+		task.cache.set(regs);
+		Ok(())
+	}
+}
+
+// Tracer whose hooks are async functions and whose stops are awaited on
+// the reactor instead of in a blocking waitpid(). Any number of them can
+// share one block_on_local() thread, each run() in its own spawn_local()
+// task. Hooks are stepped with the same semantics as Tracer scripts, and
+// the threads and children of the tracee are followed as a Tracer does.
+pub struct AsyncTracer {
+	tracee: Tracee,
+	shared: Rc<Shared>,
+	// Indexed by syscall number
+	hooks: Vec<Option<(Vec<Predicate>, AsyncHook)>>,
+}
+
+impl AsyncTracer {
+	// Forks the program: call it from the thread that runs the tracer
+	pub fn spawn(prog_path: &Path, args: &[String]) -> Result<Self, AsyncError> {
+		let sigchld = signal(SignalKind::child()).map_err(|e| format!("SIGCHLD: {}", e))?;
+		let tracee = Tracee::spawn_with_args(prog_path, args)?;
+		let pid = tracee.pid();
+
+		let fd = unsafe { libc::syscall(libc::SYS_pidfd_open, pid.as_raw(), 0) };
+		if fd < 0 {
+			return Err(format!("pidfd_open({}): {}", pid, errno::errno()));
+		}
+		let pidfd = AsyncFd::new(PidFd(fd as RawFd)).map_err(|e| format!("pidfd: {}", e))?;
+
+		Ok(AsyncTracer {
+			tracee,
+			shared: Rc::new(Shared {
+				pidfd,
+				sigchld: RefCell::new(sigchld),
+				busy: Cell::new(false),
+				task: RefCell::new(Task::new(pid)),
+				tasks: RefCell::new(Tasks::new()),
+				syscall: Cell::new((0, [0; 6])),
+				strings: RefCell::new(StringReader::new(libc::PATH_MAX as usize)),
+			}),
+			hooks: (0..NR_SYSCALLS).map(|_| None).collect(),
+		})
+	}
+
+	pub fn pid(&self) -> Pid {
+		self.tracee.pid()
+	}
+
+	// The tracee stops at sysno when every predicate holds, and the hook
+	// then runs to completion before it resumes
+	pub fn hook<F, Fut>(&mut self, sysno: nc::sysno::Sysno, predicates: &[Predicate], hook: F) -> Result<(), AsyncError>
+	where
+		F: Fn(Stop) -> Fut + 'static,
+		Fut: Future<Output = Result<(), AsyncError>> + 'static,
+	{
+		let hook: AsyncHook = Rc::new(move |stop| Box::pin(hook(stop)) as HookFuture);
+		match self.hooks.get_mut(sysno as usize) {
+			None => Err(format!("{} is not a syscall number", sysno)),
+			Some(Some(_)) => Err(format!("{} is already hooked", sysno)),
+			Some(slot) => {
+				*slot = Some((predicates.to_vec(), hook));
+				Ok(())
+			}
+		}
+	}
+
+	// Resolves once the tracee and every task it started exit
+	pub async fn run(self) -> Result<(), AsyncError> {
+		let shared = &self.shared;
+		let hooked: Vec<(nc::sysno::Sysno, &[Predicate])> = self.hooks.iter()
+			.enumerate()
+			.filter_map(|(sysno, hook)| hook.as_ref()
+						.map(|(preds, _)| (sysno as nc::sysno::Sysno, &preds[..])))
+			.collect();
+		// The tracee waits in Tracee::start() for the filter
+		Filter::trace(&hooked).send(self.tracee.filter_tx())?;
+
+		// Stopped by its execve()
+		shared.wait(&[self.tracee.pid()]).await?;
+		shared.task.borrow().setoptions()?;
+		shared.task.borrow_mut().resume(None)?;
+
+		loop {
+			let pids = shared.tasks.borrow().pids(&shared.task.borrow());
+			let status = shared.wait(&pids).await?;
+			let stop = shared.tasks.borrow_mut().stopped(&mut shared.task.borrow_mut(), status)?;
+			let status = match stop {
+				TaskStop::Handle(status) => status,
+				TaskStop::Resume => WaitStatus::StillAlive,
+				TaskStop::Gone if shared.tasks.borrow().alive(&shared.task.borrow()) => continue,
+				TaskStop::Gone => return Ok(()),
+			};
+			let mut sig = None;
+			match status {
+				WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_SECCOMP) => {
+					let syscall = {
+						let mut task = shared.task.borrow_mut();
+						task.cache.stopped();
+						task.at_entry = true;
+						task.cache.syscall()?
+					};
+					shared.syscall.set(syscall);
+					if let Some(Some((_, hook))) = self.hooks.get(syscall.0 as usize) {
+						hook(Stop(shared.clone())).await?;
+					}
+				}
+				WaitStatus::Stopped(_, signal) => {
+					// Signal-delivery-stop: pass the signal on
+					sig = Some(signal);
+				}
+				_ => {}
+			}
+			shared.task.borrow_mut().resume(sig)?;
+		}
+	}
+}
@@ -1,10 +1,6 @@
 use std::ffi::CString;
-use serde_big_array::big_array;
 use libc::{sockaddr_un, sa_family_t, c_char};
-use serde::{Serialize, Deserialize};
-
-big_array! { BigArray;
-			 +108, }
+use crate::util::Plain;
 
 macro_rules! impl_into_cchar_arr {
 	($name:ident, $num:expr) => {
@@ -23,19 +19,11 @@ macro_rules! impl_into_cchar_arr {
 
 impl_into_cchar_arr! {into_cchar_arr_108, 108}
 
-#[derive(Serialize, Deserialize)]
-#[serde(remote = "sockaddr_un")]
-struct SockaddrUnDef {
-	pub sun_family: sa_family_t,
-	#[serde(with = "BigArray")]
-	pub sun_path: [c_char; 108]
-}
+#[derive(Clone, Copy)]
+#[repr(transparent)]
+pub struct SockaddrUn(sockaddr_un);
 
-#[derive(Serialize, Deserialize)]
-pub struct SockaddrUn(
-	#[serde(with = "SockaddrUnDef")]
-	sockaddr_un
-);
+unsafe impl Plain for SockaddrUn {}
 
 impl SockaddrUn {
 	pub fn new<T: Into<Vec<u8>>>(sun_family: sa_family_t,
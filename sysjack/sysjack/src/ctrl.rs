@@ -1,5 +1,7 @@
 extern crate nc;
 
+use std::collections::BTreeMap;
+use std::rc::Rc;
 use crate::regs::{Reg, Word};
 
 #[derive(Clone)]
@@ -27,6 +29,33 @@ pub enum Val {
 	Var(String),
 }
 
+// A condition on one raw argument register, compared as a 64-bit value.
+// Unlike Activation, it is compiled into the seccomp filter: the tracee
+// only stops at the syscall when all of the script's predicates hold.
+#[derive(Clone, Copy, Debug)]
+pub enum Predicate {
+	// args[idx] == value
+	Eq(usize, Reg),
+	// args[idx] != value
+	Ne(usize, Reg),
+	// args[idx] & mask == value
+	MaskedEq(usize, Reg, Reg),
+}
+
+impl Predicate {
+	// An int argument: the kernel reads its low 32 bits only, and callers
+	// may leave the upper ones zero, e.g. openat(AT_FDCWD, ...) from glibc
+	pub fn int_eq(idx: usize, value: i32) -> Self {
+		Predicate::MaskedEq(idx, 0xffff_ffff, value as u32 as Reg)
+	}
+
+	pub fn arg(&self) -> usize {
+		match *self {
+			Predicate::Eq(idx, _) | Predicate::Ne(idx, _) | Predicate::MaskedEq(idx, _, _) => idx,
+		}
+	}
+}
+
 #[derive(Debug)]
 pub enum ActivationError {
 	ArgumentNotEnough,
@@ -43,7 +72,7 @@ pub trait Activation {
 	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError>;
 }
 
-impl Activation for &dyn Fn(Reg) -> bool {
+impl<'f> Activation for dyn Fn(Reg) -> bool + 'f {
 	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
 		if args.len() < 1 {
 			Err(ActivationError::ArgumentNotEnough)
@@ -53,7 +82,7 @@ impl Activation for &dyn Fn(Reg) -> bool {
 	}
 }
 
-impl Activation for &dyn Fn(Reg, Reg) -> bool {
+impl<'f> Activation for dyn Fn(Reg, Reg) -> bool + 'f {
 	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
 		if args.len() < 2 {
 			Err(ActivationError::ArgumentNotEnough)
@@ -64,7 +93,7 @@ impl Activation for &dyn Fn(Reg, Reg) -> bool {
 	}
 }
 
-impl Activation for &dyn Fn(Reg, Reg, Reg) -> bool {
+impl<'f> Activation for dyn Fn(Reg, Reg, Reg) -> bool + 'f {
 	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
 		if args.len() < 3 {
 			Err(ActivationError::ArgumentNotEnough)
@@ -76,7 +105,7 @@ impl Activation for &dyn Fn(Reg, Reg, Reg) -> bool {
 	}
 }
 
-impl Activation for &dyn Fn(Reg, Reg, Reg, Reg) -> bool {
+impl<'f> Activation for dyn Fn(Reg, Reg, Reg, Reg) -> bool + 'f {
 	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
 		if args.len() < 4 {
 			Err(ActivationError::ArgumentNotEnough)
@@ -89,6 +118,26 @@ impl Activation for &dyn Fn(Reg, Reg, Reg, Reg) -> bool {
 	}
 }
 
+// Closures are used through a reference, or through an Rc or Box when a
+// script must own its activation, e.g. one built per tracee
+impl<T: Activation + ?Sized> Activation for &T {
+	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
+		(**self).signal(args)
+	}
+}
+
+impl<T: Activation + ?Sized> Activation for Rc<T> {
+	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
+		(**self).signal(args)
+	}
+}
+
+impl<T: Activation + ?Sized> Activation for Box<T> {
+	fn signal(&self, args: &[Reg]) -> Result<bool, ActivationError> {
+		(**self).signal(args)
+	}
+}
+
 #[derive(Clone)]
 pub struct ScriptStarter<A: Activation>
 {
@@ -109,14 +158,55 @@ impl<A: Activation> ScriptStarter<A> {
 pub enum Instruction {
 	Call{ ctrl: CallControl, sysno: nc::sysno::Sysno, vals: Vec<Val> },
 	Alloc{ blob: Vec<Word>, name: String },
+	// A connection from the tracer's SocketPool, installed in the tracee:
+	// name is its descriptor there
+	Install{ name: String },
 	Ret{ val: Val },
 }
 
+// What build() turns a Val into: a variable becomes the index of its
+// slot in the tracer's value array
+#[derive(Clone, Copy)]
+pub enum Operand {
+	Raw(Reg),
+	Slot(usize),
+}
+
+// SkipControl with its register and value names resolved to slots
+#[derive(Clone, Copy)]
+pub enum Start {
+	Skip { regs_enter: usize },
+	Keep { regs_enter: usize, regs_exit: usize, ret: usize },
+}
+
+// Instruction with every name resolved to a slot. Register sets and values
+// are separate namespaces, as are their slot arrays.
+#[derive(Clone)]
+pub enum Op {
+	Call { sysno: nc::sysno::Sysno, args: Vec<Operand>, regs_enter: usize, regs_exit: usize, ret: usize },
+	Alloc { blob: Vec<Word>, slot: usize },
+	Install { slot: usize },
+	Ret { val: Operand },
+}
+
+// Upper bound of the arguments a Call can pass
+pub const MAX_ARGS: usize = 6;
+
+// Upper bound of the predicates of a script, which keeps the filter's
+// jumps within their 8-bit offsets
+pub const MAX_PREDICATES: usize = 16;
+
 #[derive(Clone)]
 pub struct Script<A: Activation> {
-	pub starter: ScriptStarter<A>,
+	// Checked by the seccomp filter, then the activation refines them
+	pub predicates: Vec<Predicate>,
+	pub activation: A,
+	pub start: Start,
 	pub fail_ctrl: FailControl,
-	pub intrs: Vec<Instruction>,
+	pub ops: Vec<Op>,
+	// Slots the tracer must provide to run the script
+	pub nregs: usize,
+	pub nvals: usize,
 }
 
 impl<A: Activation> Script<A> {
@@ -124,14 +214,43 @@ impl<A: Activation> Script<A> {
 		ScriptBuilder {
 			starter: None,
 			fail_ctrl: None,
+			predicates: Vec::new(),
 			intrs: Vec::new()
 		}
 	}
 }
 
+// Names to slots, for one namespace. Defining a name again reuses its slot,
+// the later value replaces the earlier one.
+#[derive(Default)]
+struct Slots(BTreeMap<String, usize>);
+
+impl Slots {
+	fn define(&mut self, name: &str) -> usize {
+		let next = self.0.len();
+		*self.0.entry(name.to_owned()).or_insert(next)
+	}
+
+	fn len(&self) -> usize {
+		self.0.len()
+	}
+}
+
+// Values can only be used once an earlier step has defined them
+fn compile_val(vals: &Slots, val: &Val, at: usize) -> Result<Operand, ScriptBuilderError> {
+	match val {
+		Val::Raw(reg) => Ok(Operand::Raw(*reg)),
+		Val::Var(name) => match vals.0.get(name) {
+			Some(slot) => Ok(Operand::Slot(*slot)),
+			None => Err(format!("instruction {}: {} is not defined", at, name)),
+		}
+	}
+}
+
 pub struct ScriptBuilder<A: Activation> {
 	starter: Option<ScriptStarter<A>>,
 	fail_ctrl: Option<FailControl>,
+	predicates: Vec<Predicate>,
 	intrs: Vec<Instruction>
 }
 
@@ -147,6 +266,13 @@ impl<A: Activation> ScriptBuilder<A> {
 		self
 	}
 
+	// Every predicate must hold for the script to run
+	pub fn when(&mut self,
+				predicate: Predicate) -> &mut Self {
+		self.predicates.push(predicate);
+		self
+	}
+
 	pub fn call(&mut self,
 				ctrl: CallControl,
 				sysno: nc::sysno::Sysno,
@@ -169,6 +295,14 @@ impl<A: Activation> ScriptBuilder<A> {
 		self
 	}
 
+	pub fn install(&mut self,
+				   name: String) -> &mut Self {
+		self.intrs.push(Instruction::Install {
+			name
+		});
+		self
+	}
+
 	pub fn ret(&mut self,
 			   val: Val) -> &mut Self {
 		self.intrs.push(Instruction::Ret {
@@ -185,15 +319,84 @@ impl<A: Activation> ScriptBuilder<A> {
 				Err("no instruction".to_owned())
 			} else {
 				if let Some(Instruction::Ret {..}) = self.intrs.last() {
-					Ok(Script {
-						starter: self.starter.unwrap(),
-						fail_ctrl: self.fail_ctrl.unwrap(),
-						intrs: self.intrs
-					})
+					self.compile()
 				} else {
 					Err("the last instruction is not Ret".to_owned())
 				}
 			}
 		}
 	}
+
+	fn compile(self) -> Result<Script<A>, ScriptBuilderError> {
+		let mut regs = Slots::default();
+		let mut vals = Slots::default();
+		let starter = self.starter.unwrap();
+
+		if self.predicates.len() > MAX_PREDICATES {
+			return Err(format!("{} predicates, at most {} are checked",
+							   self.predicates.len(), MAX_PREDICATES));
+		}
+		if let Some(pred) = self.predicates.iter().find(|p| p.arg() >= MAX_ARGS) {
+			return Err(format!("{:?}: there are {} arguments", pred, MAX_ARGS));
+		}
+
+		let start = match &starter.skip_ctrl {
+			SkipControl::Skip {regs_enter_name} => Start::Skip {
+				regs_enter: regs.define(regs_enter_name),
+			},
+			SkipControl::Keep {regs_enter_name, regs_exit_name, ret_name} => Start::Keep {
+				regs_enter: regs.define(regs_enter_name),
+				regs_exit: regs.define(regs_exit_name),
+				ret: vals.define(ret_name),
+			},
+		};
+
+		let mut ops = Vec::with_capacity(self.intrs.len());
+		for (at, instr) in self.intrs.into_iter().enumerate() {
+			let op = match instr {
+				Instruction::Call {ctrl, sysno, vals: args} => {
+					if args.len() > MAX_ARGS {
+						return Err(format!("instruction {}: {} arguments, at most {} are passed",
+										   at, args.len(), MAX_ARGS));
+					}
+					let args = args.iter()
+						.map(|v| compile_val(&vals, v, at))
+						.collect::<Result<Vec<Operand>, _>>()?;
+					Op::Call {
+						sysno,
+						args,
+						regs_enter: regs.define(&ctrl.regs_enter_name),
+						regs_exit: regs.define(&ctrl.regs_exit_name),
+						ret: vals.define(&ctrl.ret_name),
+					}
+				}
+				Instruction::Alloc {blob, name} => {
+					if blob.len() == 0 {
+						return Err(format!("instruction {}: zero-sized blob", at));
+					}
+					Op::Alloc {
+						slot: vals.define(&name),
+						blob,
+					}
+				}
+				Instruction::Install {name} => Op::Install {
+					slot: vals.define(&name),
+				},
+				Instruction::Ret {val} => Op::Ret {
+					val: compile_val(&vals, &val, at)?,
+				},
+			};
+			ops.push(op);
+		}
+
+		Ok(Script {
+			predicates: self.predicates,
+			activation: starter.activation,
+			start,
+			fail_ctrl: self.fail_ctrl.unwrap(),
+			ops,
+			nregs: regs.len(),
+			nvals: vals.len(),
+		})
+	}
 }
@@ -0,0 +1,152 @@
+extern crate nc;
+
+use std::collections::HashMap;
+use std::marker::PhantomData;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
+use nix::unistd::Pid;
+use nix::sys::wait::{waitpid, WaitPidFlag, WaitStatus};
+use crate::ctrl::{Script, Activation};
+use crate::trace::{Tracee, Tracer, ExecMode};
+
+type GroupError = String;
+
+// Many tracees with the same hooks, sharded over tracer threads.
+//
+// A tracee is forked by the thread it is assigned to, which makes that
+// thread its ptracer for good: the kernel only takes ptrace requests for a
+// tracee from the thread that traces it. Program i goes to thread
+// i % threads. Each thread waits on its own tracees only (__WNOTHREAD) and
+// keeps a Tracer per tracee, so script variables, the Alloc arena and the
+// saved registers are per tracee. The threads and children a tracee starts
+// are traced by the same thread, and handled by the tracee's Tracer.
+//
+// The hooks are built once per tracee, in its tracer thread, by
+// make_hooks(pid). Activations don't need to be Send, e.g. an
+// Rc<dyn Fn(...)> that reads strings out of that pid.
+pub struct TracerGroup<A, F> {
+	threads: usize,
+	progs: Vec<PathBuf>,
+	mode: ExecMode,
+	make_hooks: Arc<F>,
+	activation: PhantomData<fn() -> A>,
+}
+
+impl<A, F> TracerGroup<A, F>
+where
+	A: Activation + Clone + 'static,
+	F: Fn(Pid) -> Vec<(nc::sysno::Sysno, Script<A>)> + Send + Sync + 'static,
+{
+	pub fn new(threads: usize, make_hooks: F) -> Self {
+		TracerGroup {
+			threads: std::cmp::max(threads, 1),
+			progs: Vec::new(),
+			mode: ExecMode::Step,
+			make_hooks: Arc::new(make_hooks),
+			activation: PhantomData,
+		}
+	}
+
+	pub fn set_mode(&mut self, mode: ExecMode) {
+		self.mode = mode;
+	}
+
+	// Queues a program for sync(). Returns the tracer thread it goes to.
+	pub fn add(&mut self, prog_path: &Path) -> usize {
+		self.progs.push(prog_path.to_owned());
+		(self.progs.len() - 1) % self.threads
+	}
+
+	// Starts every queued program and blocks until all of them exit
+	pub fn sync(&mut self) -> Result<(), GroupError> {
+		let mut handles = Vec::new();
+		for shard in 0..self.threads {
+			let progs: Vec<PathBuf> = self.progs.iter()
+				.skip(shard)
+				.step_by(self.threads)
+				.cloned()
+				.collect();
+			if progs.is_empty() {
+				continue;
+			}
+			let make_hooks = self.make_hooks.clone();
+			let mode = self.mode;
+			let handle = thread::Builder::new()
+				.name(format!("tracer-{}", shard))
+				.spawn(move || run_shard(&progs, mode, &*make_hooks))
+				.map_err(|e| format!("starting tracer thread {}: {}", shard, e))?;
+			handles.push(handle);
+		}
+		self.progs.clear();
+
+		// Every thread is joined, the first error is the one reported
+		let mut res = Ok(());
+		for handle in handles {
+			let shard_res = handle.join()
+				.unwrap_or_else(|_| Err("a tracer thread panicked".to_owned()));
+			if res.is_ok() {
+				res = shard_res;
+			}
+		}
+		res
+	}
+}
+
+fn run_shard<A, F>(progs: &[PathBuf], mode: ExecMode, make_hooks: &F) -> Result<(), GroupError>
+where
+	A: Activation + Clone,
+	F: Fn(Pid) -> Vec<(nc::sysno::Sysno, Script<A>)>,
+{
+	let tracees = progs.iter()
+		.map(|prog| Tracee::spawn(prog))
+		.collect::<Result<Vec<Tracee>, _>>()?;
+
+	let mut tracers = HashMap::new();
+	// The tracee of each task: threads and children are followed too
+	let mut owners = HashMap::new();
+	for tracee in tracees.iter() {
+		let mut tracer = Tracer::new(tracee);
+		tracer.set_mode(mode);
+		for (sysno, script) in make_hooks(tracee.pid()) {
+			tracer.hook(sysno, script)?;
+		}
+		tracer.attach()?;
+		tracers.insert(tracee.pid(), tracer);
+		owners.insert(tracee.pid(), tracee.pid());
+	}
+	// Stops of new tasks that came before the clone event of their parent
+	let mut early: HashMap<Pid, WaitStatus> = HashMap::new();
+
+	while !tracers.is_empty() {
+		// waitid(P_ALL), limited to the tracees of this thread
+		let status = waitpid(None, Some(WaitPidFlag::__WALL | WaitPidFlag::__WNOTHREAD))
+			.map_err(|e| format!("waitpid(): {}", e))?;
+		let pid = match status.pid() {
+			Some(pid) => pid,
+			None => continue,
+		};
+		let owner = match owners.get(&pid) {
+			Some(owner) => *owner,
+			None => {
+				early.insert(pid, status);
+				continue;
+			}
+		};
+		let tracer = tracers.get_mut(&owner).unwrap();
+		let mut pending = vec![status];
+		let mut alive = true;
+		while let Some(status) = pending.pop() {
+			alive = tracer.handle(status)?;
+			for child in tracer.spawned() {
+				owners.insert(child, owner);
+				pending.extend(early.remove(&child));
+			}
+		}
+		if !alive {
+			tracers.remove(&owner);
+			owners.retain(|_, tracee| *tracee != owner);
+		}
+	}
+	Ok(())
+}
@@ -17,5 +17,12 @@ extern crate derive_new;
 
 pub mod ctrl;
 pub mod trace;
+mod task;
+pub mod group;
+pub mod async_trace;
 pub mod util;
+pub mod mem;
+pub mod seccomp;
+pub mod pool;
+pub mod record;
 pub mod common;
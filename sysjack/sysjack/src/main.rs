@@ -1,16 +1,19 @@
 extern crate libc;
 
 use sysjack::common::{SockaddrUn};
-use sysjack::ctrl::{Val, SkipControl, ScriptStarter,
+use sysjack::ctrl::{Val, SkipControl, ScriptStarter, Predicate,
 				   FailControl, CallControl, Script};
-use sysjack::trace::{Tracee, Tracer};
-use sysjack::regs::{Register, Reg};
-use sysjack::util::struct2words;
+use sysjack::trace::{Tracee, Tracer, ExecMode};
+use sysjack::pool::SocketPool;
+use sysjack::record::{Recorder, Replayer, IO_SYSCALLS};
+use sysjack::regs::{Register, Reg, StringReader};
+use sysjack::util::{struct2words, Words};
 
 use nc::{SYS_OPENAT, SYS_SOCKET, SYS_CONNECT, AF_UNIX, SOCK_STREAM};
 use getopts::Options;
-use std::{env, path::PathBuf, process::exit};
-use nix::unistd::{fork, ForkResult, getpid};
+use std::{env, path::{Path, PathBuf}, process::exit, cell::RefCell};
+use nix::unistd::{fork, ForkResult, getpid, pipe2, close};
+use nix::fcntl::OFlag;
 use is_executable::IsExecutable;
 use std::convert::TryInto;
 
@@ -19,7 +22,7 @@ static WRITER_OUTPUT: &str = "/tmp/writer_output";
 static SOCKET_PATH: &str = "/tmp/portalsock";
 
 fn usage(prog: &str, opts: Options) {
-    let brief = format!("Usage: {} <Tracee> [options]", prog);
+    let brief = format!("Usage: {} -t <Tracee> [options] [--] [args...]", prog);
     print!("{}", opts.usage(&brief));
 }
 
@@ -27,6 +30,11 @@ fn main() -> std::io::Result<()> {
     let args: Vec<_> = env::args().collect();
     let mut opts = Options::new();
     opts.reqopt("t", "tracee", "program path", "Tracee");
+    opts.optflag("b", "batch", "run the calls of a script from a trampoline, with a single stop");
+    opts.optopt("p", "pool", "hand out connections from a pool of this many, made ahead of time", "SIZE");
+    opts.optopt("", "record", "log the I/O syscalls of the tracee instead, see sysjack::record", "LOG");
+    opts.optopt("", "replay", "serve the I/O syscalls of the tracee from a log instead", "LOG");
+    opts.optopt("", "from", "start the replay at this record", "SEQ");
 
     let matches = match opts.parse(&args[1..]) {
         Ok(m) => m,
@@ -50,23 +58,72 @@ fn main() -> std::io::Result<()> {
         }
     };
 
+    let pool_size = match matches.opt_str("pool").map(|size| size.parse::<usize>()) {
+        None => None,
+        Some(Ok(size)) => Some(size),
+        Some(Err(_)) => {
+            usage(&args[0], opts);
+            exit(1);
+        }
+    };
+
+    let replay_from = match matches.opt_str("from").map(|seq| seq.parse::<u64>()) {
+        None => 0,
+        Some(Ok(seq)) => seq,
+        Some(Err(_)) => {
+            usage(&args[0], opts);
+            exit(1);
+        }
+    };
+
     if !tracee_prog.as_path().is_executable() {
         eprintln!("{:?} does not exist or is not executable", tracee_prog);
         exit(1);
     }
 
+    // Carries the seccomp filter of the hooked syscalls to the child
+    let (filter_rx, filter_tx) = pipe2(OFlag::O_CLOEXEC).unwrap();
+
     match fork() {
         Ok(ForkResult::Child) => {
+            close(filter_tx).unwrap();
             println!("Child PID is {}", getpid());
             println!("tracee is {:?}", &tracee_prog);
-            Tracee::start(tracee_prog.as_path());
+            // As a shell would start it: our environment, the arguments
+            // that follow the options
+            let env: Vec<_> = env::vars_os()
+                .map(|(name, value)| format!("{}={}", name.to_string_lossy(), value.to_string_lossy()))
+                .collect();
+            Tracee::start_with_env(tracee_prog.as_path(), &matches.free, &env, filter_rx);
         }
         Ok(ForkResult::Parent { child: cpid, .. }) => {
-            let tracee = Tracee::new(cpid);
+            close(filter_rx).unwrap();
+            let tracee = Tracee::new(cpid, filter_tx);
             let mut tracer = Tracer::<&dyn Fn(Reg, Reg, Reg, Reg) -> bool>::new(&tracee);
-            let openat_activation = |dirfd: Reg, pathname: Reg, _flags: Reg, _mode: Reg| {
-                /* open(...) always becomes openat(AT_FDCWD, ...) in linux */
-                dirfd == nc::AT_FDCWD as Reg && pathname.resolve_string(cpid) == WRITER_OUTPUT
+            if matches.opt_present("batch") {
+                tracer.set_mode(ExecMode::Batch);
+            }
+            if let Some(log) = matches.opt_str("record") {
+                tracer.record(Recorder::create(Path::new(&log), IO_SYSCALLS).unwrap()).unwrap();
+                tracer.sync().unwrap();
+                println!("{} syscalls logged to {}", tracer.take_recorder().unwrap().len(), log);
+                return Ok(());
+            }
+            if let Some(log) = matches.opt_str("replay") {
+                let mut replayer = Replayer::open(Path::new(&log)).unwrap();
+                replayer.seek(replay_from).unwrap();
+                tracer.replay(replayer).unwrap();
+                tracer.sync().unwrap();
+                return Ok(());
+            }
+            if let Some(size) = pool_size {
+                tracer.set_pool(SocketPool::new(Path::new(SOCKET_PATH), size).unwrap());
+            }
+            let path_reader = RefCell::new(StringReader::new(libc::PATH_MAX as usize));
+            /* dirfd == AT_FDCWD is checked by the seccomp filter, see .when() below */
+            let openat_activation = |_dirfd: Reg, pathname: Reg, _flags: Reg, _mode: Reg| {
+                pathname.resolve_string(cpid, &mut path_reader.borrow_mut())
+                    .map_or(false, |path| path == WRITER_OUTPUT.as_bytes())
             };
 			let openat_activation = &openat_activation as &dyn Fn(Reg, Reg, Reg, Reg) -> bool;
             let openat_skip_control = SkipControl::Skip{
@@ -81,23 +138,30 @@ fn main() -> std::io::Result<()> {
 													 "connect_exit".to_owned(),
 													 "connect_ret".to_owned());
 			let blob = struct2words(SockaddrUn::new(AF_UNIX.try_into().unwrap(), SOCKET_PATH));
-            let bloblen = blob.len();
+            let bloblen = Words::<SockaddrUn>::LEN;
 
             let script = {
 				let mut builder = Script::builder();
                 builder.new(script_starter, fail_ctrl)
-                    .call(socket_regs_ctrl,
-                          SYS_SOCKET,
-                          vec![Val::Raw(AF_UNIX as Reg),
-                               Val::Raw(SOCK_STREAM as Reg),
-                               Val::Raw(0)])
-                    .alloc(blob, "serveraddr".to_owned())
-                    .call(connect_regs_ctrl,
-                          SYS_CONNECT,
-                          vec![Val::Var("socket_ret".to_owned()),
-                               Val::Var("serveraddr".to_owned()),
-                               Val::Raw(bloblen as Reg)])
-                    .ret(Val::Var("SocketRet".to_owned()));
+                    /* open(...) always becomes openat(AT_FDCWD, ...) in linux */
+                    .when(Predicate::int_eq(0, nc::AT_FDCWD as i32));
+                if pool_size.is_some() {
+                    /* A single recvmsg() in place of the openat() */
+                    builder.install("socket_ret".to_owned());
+                } else {
+                    builder.call(socket_regs_ctrl,
+                              SYS_SOCKET,
+                              vec![Val::Raw(AF_UNIX as Reg),
+                                   Val::Raw(SOCK_STREAM as Reg),
+                                   Val::Raw(0)])
+                        .alloc(blob, "serveraddr".to_owned())
+                        .call(connect_regs_ctrl,
+                              SYS_CONNECT,
+                              vec![Val::Var("socket_ret".to_owned()),
+                                   Val::Var("serveraddr".to_owned()),
+                                   Val::Raw(bloblen as Reg)]);
+                }
+                builder.ret(Val::Var("socket_ret".to_owned()));
 				builder.build().unwrap()
             };
 
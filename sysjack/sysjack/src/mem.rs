@@ -0,0 +1,189 @@
+use std::fs::{File, OpenOptions};
+use std::os::unix::fs::FileExt;
+use nix::unistd::Pid;
+use nix::errno::Errno;
+use nix::sys::ptrace;
+use crate::regs::{Word, Reg, WORD_SIZE, PAGE_SIZE};
+
+// Pages written by one process_vm_writev() call
+const IOV_BATCH: usize = 32;
+
+type MemError = String;
+
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum WritePath {
+	// process_vm_writev(): one syscall per IOV_BATCH pages, writable pages only
+	VmWritev,
+	// pwrite() on /proc/PID/mem: one syscall, read-only mappings too
+	ProcMem,
+	// PTRACE_POKEDATA: one syscall per word
+	PokeData,
+}
+
+// Writes blobs into a stopped tracee through the cheapest path it is
+// allowed, falling back from one to the next
+pub struct MemWriter {
+	pid: Pid,
+	path: WritePath,
+	mem: Option<File>,
+}
+
+impl MemWriter {
+	pub fn new(pid: Pid) -> Self {
+		MemWriter::with_path(pid, WritePath::VmWritev)
+	}
+
+	pub fn with_path(pid: Pid, path: WritePath) -> Self {
+		MemWriter {
+			pid,
+			path,
+			mem: None,
+		}
+	}
+
+	pub fn path(&self) -> WritePath {
+		self.path
+	}
+
+	// The tracee execve()d: an open /proc/PID/mem still refers to its old
+	// address space, so it is opened again on the next write
+	pub fn exec(&mut self) {
+		self.mem = None;
+	}
+
+	pub fn write_words(&mut self, addr: Reg, words: &[Word]) -> Result<(), MemError> {
+		let bytes = unsafe {
+			std::slice::from_raw_parts(words.as_ptr() as *const u8, words.len() * WORD_SIZE)
+		};
+		self.write(addr, bytes)
+	}
+
+	// A path that is denied outright is not tried again; one that fails on
+	// this range, e.g. process_vm_writev() on a read-only page, is only
+	// skipped for this write
+	pub fn write(&mut self, addr: Reg, bytes: &[u8]) -> Result<(), MemError> {
+		if self.path == WritePath::VmWritev {
+			match self.write_vm(addr, bytes) {
+				Ok(()) => return Ok(()),
+				Err(Errno::EPERM) | Err(Errno::ENOSYS) => {
+					self.path = WritePath::ProcMem;
+				}
+				Err(_) => {
+					return self.write_proc_mem(addr, bytes)
+						.or_else(|_| self.write_poke(addr, bytes));
+				}
+			}
+		}
+		if self.path == WritePath::ProcMem {
+			match self.write_proc_mem(addr, bytes) {
+				Ok(()) => return Ok(()),
+				Err(Errno::EACCES) | Err(Errno::EPERM) | Err(Errno::ENOENT) => {
+					self.path = WritePath::PokeData;
+				}
+				Err(_) => {}
+			}
+		}
+		self.write_poke(addr, bytes)
+	}
+
+	// Reads back words the tracee wrote, e.g. the trampoline's results
+	pub fn read_words(&mut self, addr: Reg, words: &mut [Word]) -> Result<(), MemError> {
+		let bytes = unsafe {
+			std::slice::from_raw_parts_mut(words.as_mut_ptr() as *mut u8, words.len() * WORD_SIZE)
+		};
+		self.read(addr, bytes)
+	}
+
+	#[allow(deprecated)]
+	pub fn read(&mut self, addr: Reg, bytes: &mut [u8]) -> Result<(), MemError> {
+		let len = bytes.len();
+		if self.path == WritePath::VmWritev {
+			let local = libc::iovec { iov_base: bytes.as_mut_ptr() as *mut libc::c_void, iov_len: len };
+			let remote = libc::iovec { iov_base: addr as *mut libc::c_void, iov_len: len };
+			let got = unsafe {
+				libc::process_vm_readv(self.pid.as_raw(), &local, 1, &remote, 1, 0)
+			};
+			if got == len as isize {
+				return Ok(());
+			}
+		}
+		for (idx, chunk) in bytes.chunks_mut(WORD_SIZE).enumerate() {
+			let at = (addr as usize + idx * WORD_SIZE) as *mut core::ffi::c_void;
+			let word = unsafe {
+				ptrace::ptrace(ptrace::Request::PTRACE_PEEKDATA, self.pid, at,
+							   0 as *mut core::ffi::c_void)
+			}.map_err(|e| format!("PTRACE_PEEKDATA at {:?}: {}", at, e))?;
+			chunk.copy_from_slice(&word.to_le_bytes()[..chunk.len()]);
+		}
+		Ok(())
+	}
+
+	fn write_vm(&mut self, addr: Reg, bytes: &[u8]) -> Result<(), Errno> {
+		let mut done = 0;
+		while done < bytes.len() {
+			let mut remote = [libc::iovec { iov_base: std::ptr::null_mut(), iov_len: 0 }; IOV_BATCH];
+			let mut n = 0;
+			let mut want = 0;
+			while n < IOV_BATCH && done + want < bytes.len() {
+				let at = addr as usize + done + want;
+				let chunk = std::cmp::min(PAGE_SIZE - (at & (PAGE_SIZE - 1)),
+										  bytes.len() - done - want);
+				remote[n] = libc::iovec { iov_base: at as *mut libc::c_void, iov_len: chunk };
+				n += 1;
+				want += chunk;
+			}
+
+			let local = libc::iovec {
+				iov_base: bytes[done..].as_ptr() as *mut libc::c_void,
+				iov_len: want,
+			};
+			let put = unsafe {
+				libc::process_vm_writev(self.pid.as_raw(), &local, 1,
+										remote.as_ptr(), n as libc::c_ulong, 0)
+			};
+			if put < 0 {
+				return Err(Errno::last());
+			}
+			if (put as usize) < want {
+				return Err(Errno::EFAULT);
+			}
+			done += want;
+		}
+		Ok(())
+	}
+
+	fn write_proc_mem(&mut self, addr: Reg, bytes: &[u8]) -> Result<(), Errno> {
+		let to_errno = |e: std::io::Error| Errno::from_i32(e.raw_os_error().unwrap_or(0));
+		if self.mem.is_none() {
+			let file = OpenOptions::new()
+				.write(true)
+				.open(format!("/proc/{}/mem", self.pid))
+				.map_err(to_errno)?;
+			self.mem = Some(file);
+		}
+		self.mem.as_ref().unwrap().write_all_at(bytes, addr).map_err(to_errno)
+	}
+
+	#[allow(deprecated)]
+	fn write_poke(&mut self, addr: Reg, bytes: &[u8]) -> Result<(), MemError> {
+		for (idx, chunk) in bytes.chunks(WORD_SIZE).enumerate() {
+			let at = (addr as usize + idx * WORD_SIZE) as *mut core::ffi::c_void;
+			let mut wordbytes = [0u8; WORD_SIZE];
+			if chunk.len() < WORD_SIZE {
+				// Keep the bytes past the end of the blob
+				let word = unsafe {
+					ptrace::ptrace(ptrace::Request::PTRACE_PEEKDATA, self.pid, at,
+								   0 as *mut core::ffi::c_void)
+				}.map_err(|e| format!("PTRACE_PEEKDATA at {:?}: {}", at, e))?;
+				wordbytes = word.to_le_bytes();
+			}
+			wordbytes[..chunk.len()].copy_from_slice(chunk);
+
+			unsafe {
+				ptrace::ptrace(ptrace::Request::PTRACE_POKEDATA, self.pid, at,
+							   Word::from_le_bytes(wordbytes) as *mut core::ffi::c_void)
+			}.map_err(|e| format!("PTRACE_POKEDATA at {:?}: {}", at, e))?;
+		}
+		Ok(())
+	}
+}
@@ -0,0 +1,135 @@
+use std::mem;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use libc::{c_int, c_void};
+use crate::regs::{Word, Reg, WORD_SIZE};
+use crate::util::Plain;
+
+type PoolError = String;
+
+// Connections to a Unix socket server, made ahead of time, that scripts
+// hand to the tracee with Instruction::Install instead of a socket() and
+// connect() of their own. The tracer tops the pool up while the tracee
+// runs, so connecting is off the path of the hook.
+pub struct SocketPool {
+	path: PathBuf,
+	size: usize,
+	conns: Vec<UnixStream>,
+}
+
+impl SocketPool {
+	pub fn new(path: &Path, size: usize) -> Result<Self, PoolError> {
+		let size = std::cmp::max(size, 1);
+		let mut pool = SocketPool {
+			path: path.to_owned(),
+			size,
+			conns: Vec::with_capacity(size),
+		};
+		pool.fill()?;
+		Ok(pool)
+	}
+
+	// Connections ready to be handed out
+	pub fn len(&self) -> usize {
+		self.conns.len()
+	}
+
+	// Makes connections until the pool is full again
+	pub fn fill(&mut self) -> Result<(), PoolError> {
+		while self.conns.len() < self.size {
+			let conn = UnixStream::connect(&self.path)
+				.map_err(|e| format!("connecting to {:?}: {}", self.path, e))?;
+			self.conns.push(conn);
+		}
+		Ok(())
+	}
+
+	// Sends a connection over sock with SCM_RIGHTS. Our descriptor of it
+	// is closed, the one in flight keeps it open.
+	pub fn send(&mut self, sock: RawFd) -> Result<(), PoolError> {
+		if self.conns.is_empty() {
+			self.fill()?;
+		}
+		let conn = self.conns.pop().unwrap();
+
+		let mut data = [0u8; 1];
+		let mut iov = libc::iovec { iov_base: data.as_mut_ptr() as *mut c_void, iov_len: 1 };
+		let mut cmsg: FdCmsg = unsafe { mem::zeroed() };
+		cmsg.hdr.cmsg_len = unsafe { libc::CMSG_LEN(mem::size_of::<c_int>() as u32) } as usize;
+		cmsg.hdr.cmsg_level = libc::SOL_SOCKET;
+		cmsg.hdr.cmsg_type = libc::SCM_RIGHTS;
+		cmsg.fd = conn.as_raw_fd();
+		let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+		msg.msg_iov = &mut iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &mut cmsg as *mut FdCmsg as *mut c_void;
+		msg.msg_controllen = mem::size_of::<FdCmsg>();
+
+		if unsafe { libc::sendmsg(sock, &msg, 0) } < 0 {
+			return Err(format!("sendmsg(): {}", errno::errno()));
+		}
+		Ok(())
+	}
+}
+
+// A control message carrying one descriptor: CMSG_SPACE(sizeof(int))
+// bytes, as the kernel lays it out
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct FdCmsg {
+	hdr: libc::cmsghdr,
+	fd: c_int,
+	pad: c_int,
+}
+
+// What the tracee's recvmsg() receives a connection into, built for the
+// tracee address it is copied to: its pointers point into that copy
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct FdMsg {
+	msg: libc::msghdr,
+	iov: libc::iovec,
+	cmsg: FdCmsg,
+	data: u8,
+}
+
+unsafe impl Plain for FdMsg {}
+
+impl FdMsg {
+	// Words of the control message, read back once recvmsg() returned
+	pub(crate) const CMSG_WORDS: usize = mem::size_of::<FdCmsg>() / WORD_SIZE;
+
+	pub(crate) fn new(addr: Reg) -> Self {
+		let mut fdmsg: FdMsg = unsafe { mem::zeroed() };
+		let base = &fdmsg as *const FdMsg as usize;
+		let at = |field: usize| (addr + (field - base) as Reg) as *mut c_void;
+
+		fdmsg.iov.iov_base = at(&fdmsg.data as *const u8 as usize);
+		fdmsg.iov.iov_len = 1;
+		fdmsg.msg.msg_iov = at(&fdmsg.iov as *const libc::iovec as usize) as *mut libc::iovec;
+		fdmsg.msg.msg_iovlen = 1;
+		fdmsg.msg.msg_control = at(&fdmsg.cmsg as *const FdCmsg as usize);
+		fdmsg.msg.msg_controllen = mem::size_of::<FdCmsg>();
+		fdmsg
+	}
+
+	// Where the control message is, in the copy at addr
+	pub(crate) fn cmsg_addr(addr: Reg) -> Reg {
+		let fdmsg: FdMsg = unsafe { mem::zeroed() };
+		addr + (&fdmsg.cmsg as *const FdCmsg as usize - &fdmsg as *const FdMsg as usize) as Reg
+	}
+
+	// The descriptor the tracee got, out of the control message words
+	pub(crate) fn received(words: &[Word; FdMsg::CMSG_WORDS]) -> Option<Reg> {
+		let cmsg: FdCmsg = unsafe { std::ptr::read(words.as_ptr() as *const FdCmsg) };
+		let len = unsafe { libc::CMSG_LEN(mem::size_of::<c_int>() as u32) } as usize;
+		if cmsg.hdr.cmsg_len == len &&
+			cmsg.hdr.cmsg_level == libc::SOL_SOCKET &&
+			cmsg.hdr.cmsg_type == libc::SCM_RIGHTS {
+			Some(cmsg.fd as Reg)
+		} else {
+			None
+		}
+	}
+}
@@ -0,0 +1,357 @@
+extern crate nc;
+
+use std::ffi::OsString;
+use std::fs::{File, OpenOptions};
+use std::mem;
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use crate::regs::{Word, Reg, SWord, WORD_SIZE, NR_SYSCALLS};
+
+// Syscall logs, for Tracer::record() and Tracer::replay().
+//
+// A log is two append-only files, written through shared mappings:
+//
+//   PATH      header: MAGIC, VERSION, then a bitmap of the logged syscalls
+//             records: sysno, args[6], ret, out_len, then the out_len
+//             bytes the kernel wrote, zero-padded to a word
+//   PATH.idx  header: MAGIC, VERSION
+//             the offset in PATH of each record, by sequence number
+//
+// so that a replay can start at any sequence number without reading what
+// comes before it.
+//
+// Only syscalls of the bitmap stop: the others, e.g. mmap() or brk(),
+// run for real in the replay too. Their file descriptors must not come
+// from logged syscalls: file-backed mappings of a replayed openat() fail.
+// So the syscalls of the dynamic loader, which maps the libraries it
+// opens, are not logged and run for real in the replay, and the libraries
+// must be there for it.
+
+type LogError = String;
+
+const MAGIC: Word = 0x676f_6c6b_6361_6a73; // "sjacklog"
+const VERSION: Word = 1;
+const BITMAP_WORDS: usize = NR_SYSCALLS / (8 * WORD_SIZE);
+const DATA_HEADER_WORDS: usize = 2 + BITMAP_WORDS;
+const INDEX_HEADER_WORDS: usize = 2;
+// sysno, args[6], ret, out_len
+const RECORD_WORDS: usize = 9;
+
+// Logs are grown by this much at a time
+const LOG_CHUNK: usize = 1 << 22;
+
+// The I/O of a program, as a default set of syscalls to log
+pub const IO_SYSCALLS: &[nc::sysno::Sysno] = &[
+	nc::SYS_READ, nc::SYS_WRITE, nc::SYS_PREAD64, nc::SYS_PWRITE64, nc::SYS_WRITEV,
+	nc::SYS_OPENAT, nc::SYS_CLOSE, nc::SYS_LSEEK, nc::SYS_FSTAT, nc::SYS_NEWFSTATAT,
+	nc::SYS_STATX, nc::SYS_GETDENTS64, nc::SYS_READLINKAT,
+	nc::SYS_SOCKET, nc::SYS_CONNECT, nc::SYS_SENDTO, nc::SYS_RECVFROM,
+	nc::SYS_GETRANDOM,
+];
+
+// The buffer a call of sysno with args may write its output to, and its
+// room: the count the call passes, or the size of the struct it fills.
+pub fn buffer(sysno: nc::sysno::Sysno, args: &[Reg; 6]) -> Option<(Reg, usize)> {
+	let (addr, room) = match sysno {
+		nc::SYS_READ | nc::SYS_PREAD64 | nc::SYS_RECVFROM |
+		nc::SYS_GETDENTS64 => (args[1], args[2] as usize),
+		nc::SYS_GETRANDOM => (args[0], args[1] as usize),
+		nc::SYS_READLINKAT => (args[2], args[3] as usize),
+		nc::SYS_FSTAT => (args[1], mem::size_of::<libc::stat>()),
+		nc::SYS_NEWFSTATAT => (args[2], mem::size_of::<libc::stat>()),
+		nc::SYS_STATX => (args[4], mem::size_of::<libc::statx>()),
+		_ => return None,
+	};
+	if addr == 0 || room == 0 {
+		None
+	} else {
+		Some((addr, room))
+	}
+}
+
+// The part of buffer() a syscall that returned ret wrote its output to, if
+// it is one whose output is logged. Others are logged with their return
+// value only, as is the address recvfrom() got the data from.
+pub fn output(sysno: nc::sysno::Sysno, args: &[Reg; 6], ret: Reg) -> Option<(Reg, usize)> {
+	if (ret as SWord) < 0 {
+		return None;
+	}
+	let (addr, room) = buffer(sysno, args)?;
+	let len = match sysno {
+		nc::SYS_FSTAT | nc::SYS_NEWFSTATAT | nc::SYS_STATX => room,
+		_ => (ret as usize).min(room),
+	};
+	if len == 0 {
+		None
+	} else {
+		Some((addr, len))
+	}
+}
+
+// Whether the first argument of sysno is a file descriptor, which a replay
+// holds to the record's
+pub fn fd_arg(sysno: nc::sysno::Sysno) -> bool {
+	match sysno {
+		nc::SYS_READ | nc::SYS_WRITE | nc::SYS_PREAD64 | nc::SYS_PWRITE64 |
+		nc::SYS_WRITEV | nc::SYS_OPENAT | nc::SYS_CLOSE | nc::SYS_LSEEK |
+		nc::SYS_FSTAT | nc::SYS_NEWFSTATAT | nc::SYS_STATX | nc::SYS_GETDENTS64 |
+		nc::SYS_READLINKAT | nc::SYS_CONNECT | nc::SYS_SENDTO |
+		nc::SYS_RECVFROM => true,
+		_ => false,
+	}
+}
+
+fn index_path(path: &Path) -> PathBuf {
+	let mut idx = OsString::from(path.as_os_str());
+	idx.push(".idx");
+	PathBuf::from(idx)
+}
+
+// A file written through a shared mapping, grown LOG_CHUNK bytes at a
+// time. It is cut back to what was written when dropped.
+struct AppendMap {
+	file: File,
+	path: PathBuf,
+	base: *mut u8,
+	cap: usize,
+	len: usize,
+}
+
+impl AppendMap {
+	fn create(path: &Path) -> Result<Self, LogError> {
+		let file = OpenOptions::new()
+			.read(true)
+			.write(true)
+			.create(true)
+			.truncate(true)
+			.open(path)
+			.map_err(|e| format!("creating {:?}: {}", path, e))?;
+		Ok(AppendMap { file, path: path.to_owned(), base: std::ptr::null_mut(), cap: 0, len: 0 })
+	}
+
+	// Room for len more bytes, zeroed
+	fn reserve(&mut self, len: usize) -> Result<&mut [u8], LogError> {
+		if self.len + len > self.cap {
+			self.grow(self.len + len)?;
+		}
+		let buf = unsafe { std::slice::from_raw_parts_mut(self.base.add(self.len), len) };
+		self.len += len;
+		Ok(buf)
+	}
+
+	fn grow(&mut self, need: usize) -> Result<(), LogError> {
+		let cap = align!(std::cmp::max(need, 2 * self.cap), LOG_CHUNK);
+		self.file.set_len(cap as u64).map_err(|e| format!("growing {:?}: {}", self.path, e))?;
+		if !self.base.is_null() {
+			unsafe { libc::munmap(self.base as *mut libc::c_void, self.cap) };
+			self.base = std::ptr::null_mut();
+		}
+		let base = unsafe {
+			libc::mmap(std::ptr::null_mut(), cap, libc::PROT_READ | libc::PROT_WRITE,
+					   libc::MAP_SHARED, self.file.as_raw_fd(), 0)
+		};
+		if base == libc::MAP_FAILED {
+			return Err(format!("mapping {:?}: {}", self.path, errno::errno()));
+		}
+		self.base = base as *mut u8;
+		self.cap = cap;
+		Ok(())
+	}
+}
+
+impl Drop for AppendMap {
+	fn drop(&mut self) {
+		if !self.base.is_null() {
+			unsafe { libc::munmap(self.base as *mut libc::c_void, self.cap) };
+		}
+		self.file.set_len(self.len as u64).ok();
+	}
+}
+
+fn put_words(buf: &mut [u8], words: &[Word]) {
+	for (chunk, word) in buf.chunks_mut(WORD_SIZE).zip(words) {
+		chunk.copy_from_slice(&word.to_ne_bytes());
+	}
+}
+
+// Writes a log. The tracer appends to it with append().
+pub struct Recorder {
+	data: AppendMap,
+	index: AppendMap,
+	logged: Vec<bool>,
+	len: u64,
+}
+
+impl Recorder {
+	pub fn create(path: &Path, syscalls: &[nc::sysno::Sysno]) -> Result<Self, LogError> {
+		let mut logged = vec![false; NR_SYSCALLS];
+		let mut bitmap = [0 as Word; BITMAP_WORDS];
+		for &sysno in syscalls {
+			let sysno = sysno as usize;
+			if sysno >= NR_SYSCALLS {
+				return Err(format!("{} is not a syscall number", sysno));
+			}
+			logged[sysno] = true;
+			bitmap[sysno / 64] |= 1 << (sysno % 64);
+		}
+
+		let mut data = AppendMap::create(path)?;
+		let header = data.reserve(DATA_HEADER_WORDS * WORD_SIZE)?;
+		put_words(header, &[MAGIC, VERSION]);
+		put_words(&mut header[2 * WORD_SIZE..], &bitmap);
+		let mut index = AppendMap::create(&index_path(path))?;
+		put_words(index.reserve(INDEX_HEADER_WORDS * WORD_SIZE)?, &[MAGIC, VERSION]);
+
+		Ok(Recorder { data, index, logged, len: 0 })
+	}
+
+	// Records written so far
+	pub fn len(&self) -> u64 {
+		self.len
+	}
+
+	pub fn is_logged(&self, sysno: nc::sysno::Sysno) -> bool {
+		self.logged.get(sysno as usize).cloned().unwrap_or(false)
+	}
+
+	pub fn syscalls(&self) -> Vec<nc::sysno::Sysno> {
+		(0..NR_SYSCALLS).filter(|&sysno| self.logged[sysno]).map(|sysno| sysno as nc::sysno::Sysno).collect()
+	}
+
+	// Appends a record. Returns the out_len bytes of its output, to be
+	// filled in, straight from the tracee.
+	pub fn append(&mut self, sysno: nc::sysno::Sysno, args: &[Reg; 6], ret: Reg,
+				  out_len: usize) -> Result<&mut [u8], LogError> {
+		let offset = self.data.len as Word;
+		put_words(self.index.reserve(WORD_SIZE)?, &[offset]);
+		self.len += 1;
+
+		let record = self.data.reserve(RECORD_WORDS * WORD_SIZE + walign!(out_len))?;
+		put_words(record, &[sysno as Word]);
+		put_words(&mut record[WORD_SIZE..], args);
+		put_words(&mut record[7 * WORD_SIZE..], &[ret, out_len as Word]);
+		Ok(&mut record[RECORD_WORDS * WORD_SIZE..RECORD_WORDS * WORD_SIZE + out_len])
+	}
+}
+
+// A read-only mapping of a whole file
+struct Mapped {
+	base: *const u8,
+	len: usize,
+}
+
+impl Mapped {
+	fn open(path: &Path) -> Result<Self, LogError> {
+		let file = File::open(path).map_err(|e| format!("opening {:?}: {}", path, e))?;
+		let len = file.metadata().map_err(|e| format!("{:?}: {}", path, e))?.len() as usize;
+		if len == 0 {
+			return Err(format!("{:?} is not a sysjack log", path));
+		}
+		let base = unsafe {
+			libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_SHARED,
+					   file.as_raw_fd(), 0)
+		};
+		if base == libc::MAP_FAILED {
+			return Err(format!("mapping {:?}: {}", path, errno::errno()));
+		}
+		Ok(Mapped { base: base as *const u8, len })
+	}
+
+	fn words(&self) -> &[Word] {
+		unsafe { std::slice::from_raw_parts(self.base as *const Word, self.len / WORD_SIZE) }
+	}
+
+	fn bytes(&self) -> &[u8] {
+		unsafe { std::slice::from_raw_parts(self.base, self.len) }
+	}
+}
+
+impl Drop for Mapped {
+	fn drop(&mut self) {
+		unsafe { libc::munmap(self.base as *mut libc::c_void, self.len) };
+	}
+}
+
+pub struct Record<'a> {
+	pub seq: u64,
+	pub sysno: nc::sysno::Sysno,
+	pub args: [Reg; 6],
+	pub ret: Reg,
+	// What the kernel wrote, see output()
+	pub out: &'a [u8],
+}
+
+// Reads a log back, in order from a sequence number
+pub struct Replayer {
+	data: Mapped,
+	index: Mapped,
+	logged: Vec<bool>,
+	len: u64,
+	next: u64,
+}
+
+impl Replayer {
+	pub fn open(path: &Path) -> Result<Self, LogError> {
+		let data = Mapped::open(path)?;
+		let index = Mapped::open(&index_path(path))?;
+		let header = data.words();
+		if header.len() < DATA_HEADER_WORDS || header[0] != MAGIC || header[1] != VERSION ||
+			index.words().len() < INDEX_HEADER_WORDS ||
+			index.words()[0] != MAGIC || index.words()[1] != VERSION {
+			return Err(format!("{:?} is not a version {} sysjack log", path, VERSION));
+		}
+		let logged = (0..NR_SYSCALLS)
+			.map(|sysno| header[2 + sysno / 64] & (1 << (sysno % 64)) != 0)
+			.collect();
+
+		// A recorder that died left its last chunk zeroed: the records
+		// end at the first offset of 0
+		let offsets = &index.words()[INDEX_HEADER_WORDS..];
+		let len = offsets.partition_point(|&offset| offset != 0) as u64;
+
+		Ok(Replayer { data, index, logged, len, next: 0 })
+	}
+
+	pub fn len(&self) -> u64 {
+		self.len
+	}
+
+	pub fn is_logged(&self, sysno: nc::sysno::Sysno) -> bool {
+		self.logged.get(sysno as usize).cloned().unwrap_or(false)
+	}
+
+	pub fn syscalls(&self) -> Vec<nc::sysno::Sysno> {
+		(0..NR_SYSCALLS).filter(|&sysno| self.logged[sysno]).map(|sysno| sysno as nc::sysno::Sysno).collect()
+	}
+
+	// The next record next() returns
+	pub fn seek(&mut self, seq: u64) -> Result<(), LogError> {
+		if seq > self.len {
+			return Err(format!("the log has {} records, there is no record {}", self.len, seq));
+		}
+		self.next = seq;
+		Ok(())
+	}
+
+	pub fn record(&self, seq: u64) -> Option<Record<'_>> {
+		if seq >= self.len {
+			return None;
+		}
+		let offset = self.index.words()[INDEX_HEADER_WORDS + seq as usize] as usize;
+		let words = self.data.words().get(offset / WORD_SIZE..offset / WORD_SIZE + RECORD_WORDS)?;
+		let mut args = [0 as Reg; 6];
+		args.copy_from_slice(&words[1..7]);
+		let start = offset + RECORD_WORDS * WORD_SIZE;
+		let out = self.data.bytes().get(start..start + words[8] as usize)?;
+		Some(Record { seq, sysno: words[0] as nc::sysno::Sysno, args, ret: words[7], out })
+	}
+
+	pub fn next(&mut self) -> Option<Record<'_>> {
+		let seq = self.next;
+		if seq >= self.len {
+			return None;
+		}
+		self.next += 1;
+		self.record(seq)
+	}
+}
@@ -0,0 +1,184 @@
+extern crate nc;
+
+use std::fs::File;
+use std::io::{Read, Write};
+use std::os::unix::io::{FromRawFd, RawFd};
+use crate::regs::{Reg, AUDIT_ARCH};
+use crate::ctrl::Predicate;
+
+// Classic BPF, as accepted by seccomp
+const BPF_LD_W_ABS: u16 = 0x20;
+const BPF_JEQ_K: u16 = 0x15;
+const BPF_AND_K: u16 = 0x54;
+const BPF_RET_K: u16 = 0x06;
+
+const SECCOMP_MODE_FILTER: libc::c_ulong = 2;
+const SECCOMP_RET_ALLOW: u32 = 0x7fff_0000;
+const SECCOMP_RET_TRACE: u32 = 0x7ff0_0000;
+
+// Offsets into struct seccomp_data
+const DATA_NR: u32 = 0;
+const DATA_ARCH: u32 = 4;
+const DATA_ARGS: u32 = 16;
+
+type FilterError = String;
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct SockFilter {
+	code: u16,
+	jt: u8,
+	jf: u8,
+	k: u32,
+}
+
+#[repr(C)]
+struct SockFprog {
+	len: libc::c_ushort,
+	filter: *const SockFilter,
+}
+
+fn stmt(code: u16, k: u32) -> SockFilter {
+	SockFilter { code, jt: 0, jf: 0, k }
+}
+
+fn jump(code: u16, k: u32, jt: u8, jf: u8) -> SockFilter {
+	SockFilter { code, jt, jf, k }
+}
+
+// Loads one 32-bit half of args[idx], little-endian
+fn load_arg(idx: usize, high: bool) -> SockFilter {
+	stmt(BPF_LD_W_ABS, DATA_ARGS + idx as u32 * 8 + if high { 4 } else { 0 })
+}
+
+// Appends the checks of one predicate. FAIL marks the jumps that leave
+// the syscall's block; block() points them at its final ALLOW.
+const FAIL: u8 = 0xff;
+
+fn predicate(prog: &mut Vec<SockFilter>, pred: &Predicate) {
+	let halves = |v: Reg| (v as u32, (v >> 32) as u32);
+	match *pred {
+		Predicate::Eq(idx, value) => {
+			let (lo, hi) = halves(value);
+			prog.push(load_arg(idx, false));
+			prog.push(jump(BPF_JEQ_K, lo, 0, FAIL));
+			prog.push(load_arg(idx, true));
+			prog.push(jump(BPF_JEQ_K, hi, 0, FAIL));
+		}
+		Predicate::Ne(idx, value) => {
+			let (lo, hi) = halves(value);
+			prog.push(load_arg(idx, false));
+			// The low halves differ: the high ones need no check
+			prog.push(jump(BPF_JEQ_K, lo, 0, 2));
+			prog.push(load_arg(idx, true));
+			prog.push(jump(BPF_JEQ_K, hi, FAIL, 0));
+		}
+		Predicate::MaskedEq(idx, mask, value) => {
+			let (mask_lo, mask_hi) = halves(mask);
+			let (lo, hi) = halves(value);
+			prog.push(load_arg(idx, false));
+			prog.push(stmt(BPF_AND_K, mask_lo));
+			prog.push(jump(BPF_JEQ_K, lo, 0, FAIL));
+			prog.push(load_arg(idx, true));
+			prog.push(stmt(BPF_AND_K, mask_hi));
+			prog.push(jump(BPF_JEQ_K, hi, 0, FAIL));
+		}
+	}
+}
+
+// One syscall: TRACE if every predicate holds, ALLOW if one doesn't, and
+// on to the next block for any other syscall
+fn block(prog: &mut Vec<SockFilter>, sysno: nc::sysno::Sysno, preds: &[Predicate]) {
+	let mut body = Vec::new();
+	for pred in preds {
+		predicate(&mut body, pred);
+	}
+	body.push(stmt(BPF_RET_K, SECCOMP_RET_TRACE));
+	if !preds.is_empty() {
+		body.push(stmt(BPF_RET_K, SECCOMP_RET_ALLOW));
+	}
+
+	let allow = body.len() - 1;
+	for (at, insn) in body.iter_mut().enumerate() {
+		if insn.jt == FAIL {
+			insn.jt = (allow - at - 1) as u8;
+		}
+		if insn.jf == FAIL {
+			insn.jf = (allow - at - 1) as u8;
+		}
+	}
+
+	// The predicates overwrote the accumulator
+	prog.push(stmt(BPF_LD_W_ABS, DATA_NR));
+	prog.push(jump(BPF_JEQ_K, sysno as u32, 0, body.len() as u8));
+	prog.extend(body);
+}
+
+// A seccomp filter that stops the tracee (SECCOMP_RET_TRACE) on the given
+// syscalls only, when their predicates hold, and lets every other syscall
+// run without a ptrace stop
+pub struct Filter(Vec<SockFilter>);
+
+impl Filter {
+	pub fn trace(hooks: &[(nc::sysno::Sysno, &[Predicate])]) -> Self {
+		let mut prog = vec![
+			stmt(BPF_LD_W_ABS, DATA_ARCH),
+			jump(BPF_JEQ_K, AUDIT_ARCH, 1, 0),
+			stmt(BPF_RET_K, SECCOMP_RET_ALLOW),
+		];
+		for (sysno, preds) in hooks {
+			block(&mut prog, *sysno, preds);
+		}
+		prog.push(stmt(BPF_RET_K, SECCOMP_RET_ALLOW));
+		Filter(prog)
+	}
+
+	// The tracer compiles the filter once its hooks are known, after the
+	// fork, so it is handed to the tracee through a pipe. The fd is closed.
+	pub fn send(&self, fd: RawFd) -> Result<(), FilterError> {
+		let mut pipe = unsafe { File::from_raw_fd(fd) };
+		let bytes = unsafe {
+			std::slice::from_raw_parts(self.0.as_ptr() as *const u8,
+									   self.0.len() * std::mem::size_of::<SockFilter>())
+		};
+		pipe.write_all(&(self.0.len() as u32).to_ne_bytes())
+			.and_then(|_| pipe.write_all(bytes))
+			.map_err(|e| format!("sending the seccomp filter: {}", e))
+	}
+
+	pub fn receive(fd: RawFd) -> Result<Self, FilterError> {
+		let mut pipe = unsafe { File::from_raw_fd(fd) };
+		let mut len = [0u8; 4];
+		pipe.read_exact(&mut len)
+			.map_err(|e| format!("receiving the seccomp filter: {}", e))?;
+
+		let mut prog = vec![stmt(0, 0); u32::from_ne_bytes(len) as usize];
+		let bytes = unsafe {
+			std::slice::from_raw_parts_mut(prog.as_mut_ptr() as *mut u8,
+										   prog.len() * std::mem::size_of::<SockFilter>())
+		};
+		pipe.read_exact(bytes)
+			.map_err(|e| format!("receiving the seccomp filter: {}", e))?;
+		Ok(Filter(prog))
+	}
+
+	// Applies to the calling process and, across execve(), to the program
+	// it runs. The tracer must have set PTRACE_O_TRACESECCOMP before the
+	// filter first returns SECCOMP_RET_TRACE, or the syscall fails.
+	pub fn install(&self) -> Result<(), FilterError> {
+		let fprog = SockFprog {
+			len: self.0.len() as libc::c_ushort,
+			filter: self.0.as_ptr(),
+		};
+		unsafe {
+			if libc::prctl(libc::PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1 {
+				return Err(format!("prctl(PR_SET_NO_NEW_PRIVS): {}", errno::errno()));
+			}
+			if libc::prctl(libc::PR_SET_SECCOMP, SECCOMP_MODE_FILTER,
+						   &fprog as *const SockFprog, 0, 0) == -1 {
+				return Err(format!("prctl(PR_SET_SECCOMP): {}", errno::errno()));
+			}
+		}
+		Ok(())
+	}
+}
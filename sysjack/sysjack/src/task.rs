@@ -0,0 +1,375 @@
+use std::collections::{HashMap, VecDeque};
+use std::convert::TryInto;
+use std::ops::Range;
+use std::os::unix::net::UnixDatagram;
+use nix::unistd::Pid;
+use nix::errno::Errno;
+use nix::sys::wait::WaitStatus;
+use nix::sys::ptrace;
+use nix::sys::signal::Signal;
+use crate::regs::{Reg, UserRegs, RegCache};
+use crate::mem::MemWriter;
+
+type TaskError = String;
+
+// Tracee memory that Alloc blobs are carved from. It is mapped the first
+// time a script allocates and reused by every run after that.
+pub(crate) const ARENA_SIZE: usize = 64 * 1024;
+
+pub(crate) struct Arena {
+	pub(crate) base: Option<Reg>,
+	pub(crate) used: usize,
+}
+
+// The socketpair Install sends pooled connections over. The tracee's end
+// is close-on-exec, so it is opened again after an execve().
+pub(crate) struct Control {
+	pub(crate) tx: UnixDatagram,
+	// The tracee's descriptor of its end
+	pub(crate) fd: Reg,
+}
+
+// The ptrace options of every tracee. The seccomp filter is inherited
+// across clone(), fork() and execve(), and a SECCOMP_RET_TRACE without a
+// tracer fails the syscall with ENOSYS: the tasks it starts are followed.
+pub(crate) fn options() -> ptrace::Options {
+	ptrace::Options::PTRACE_O_EXITKILL |
+	ptrace::Options::PTRACE_O_TRACESYSGOOD |
+	ptrace::Options::PTRACE_O_TRACESECCOMP |
+	ptrace::Options::PTRACE_O_TRACEEXEC |
+	ptrace::Options::PTRACE_O_TRACECLONE |
+	ptrace::Options::PTRACE_O_TRACEFORK |
+	ptrace::Options::PTRACE_O_TRACEVFORK
+}
+
+// How a task is run to the stop that ends a syscall
+#[derive(Clone, Copy)]
+pub(crate) enum Step {
+	// PTRACE_SYSCALL, to the syscall-exit-stop of the syscall it is
+	// stopped in
+	Syscall,
+	// PTRACE_SINGLESTEP over the syscall it is stopped in, or in front of.
+	// Its only stop is the trap as it returns: there is no
+	// syscall-entry-stop, nor syscall-exit-stop. An injected syscall that
+	// is itself hooked makes a seccomp stop on the way, stepped past.
+	Over,
+}
+
+// The thread group of a task, from /proc
+pub(crate) fn tgid(pid: Pid) -> Result<Pid, TaskError> {
+	let path = format!("/proc/{}/status", pid);
+	let status = std::fs::read_to_string(&path).map_err(|e| format!("{}: {}", path, e))?;
+	status.lines()
+		.find_map(|line| line.strip_prefix("Tgid:"))
+		.and_then(|tgid| tgid.trim().parse().ok())
+		.map(Pid::from_raw)
+		.ok_or_else(|| format!("{}: no Tgid", path))
+}
+
+// Where the dynamic loader of pid is mapped, from /proc: where the
+// mappings of the file at AT_BASE start and end. Empty for a static
+// program.
+fn loader(pid: Pid) -> Result<Range<Reg>, TaskError> {
+	let path = format!("/proc/{}/auxv", pid);
+	let auxv = std::fs::read(&path).map_err(|e| format!("{}: {}", path, e))?;
+	let base = auxv.chunks_exact(16)
+		.map(|entry| (Reg::from_ne_bytes(entry[..8].try_into().unwrap()),
+					  Reg::from_ne_bytes(entry[8..].try_into().unwrap())))
+		.find(|&(tag, _)| tag == libc::AT_BASE)
+		.map_or(0, |(_, value)| value);
+	if base == 0 {
+		return Ok(0..0);
+	}
+
+	let path = format!("/proc/{}/maps", pid);
+	let maps = std::fs::read_to_string(&path).map_err(|e| format!("{}: {}", path, e))?;
+	// start-end perms offset dev inode path
+	let mappings: Vec<(Reg, Reg, &str)> = maps.lines()
+		.filter_map(|line| {
+			let mut fields = line.split_whitespace();
+			let range = fields.next()?;
+			let dash = range.find('-')?;
+			let start = Reg::from_str_radix(&range[..dash], 16).ok()?;
+			let end = Reg::from_str_radix(&range[dash + 1..], 16).ok()?;
+			Some((start, end, fields.nth(4)?))
+		})
+		.collect();
+	let file = match mappings.iter().find(|&&(start, _, _)| start == base) {
+		Some(&(_, _, file)) => file,
+		None => return Err(format!("{}: nothing mapped at AT_BASE {:#x}", path, base)),
+	};
+	let mut range = base..base;
+	for &(start, end, _) in mappings.iter().filter(|&&(_, _, f)| f == file) {
+		range.start = std::cmp::min(range.start, start);
+		range.end = std::cmp::max(range.end, end);
+	}
+	Ok(range)
+}
+
+// A thread or process of the tracee, and the state of its current stop.
+// A thread maps an arena and a trampoline of its own in the address space
+// it shares; a forked child starts without any, like a fresh tracee.
+pub(crate) struct Task {
+	pub(crate) pid: Pid,
+	// The registers of the stop it is at
+	pub(crate) cache: RegCache,
+	// Stopped before its syscall ran: at a seccomp stop or a
+	// syscall-entry-stop
+	pub(crate) at_entry: bool,
+	pub(crate) mem: MemWriter,
+	pub(crate) arena: Arena,
+	// Where the trampoline is mapped, once a batch has run
+	pub(crate) trampoline: Option<Reg>,
+	pub(crate) control: Option<Control>,
+	// Signals that arrived while a script was stepping an injected
+	// syscall, in order, delivered when the task resumes
+	deferred_sigs: VecDeque<Signal>,
+	// Where the dynamic loader is mapped, once asked
+	loader: Option<Range<Reg>>,
+	// Auto-attached: its first stop, a SIGSTOP, is ours
+	attaching: bool,
+	gone: bool,
+}
+
+impl Task {
+	pub(crate) fn new(pid: Pid) -> Self {
+		Task {
+			pid,
+			cache: RegCache::new(pid),
+			at_entry: false,
+			mem: MemWriter::new(pid),
+			arena: Arena { base: None, used: 0 },
+			trampoline: None,
+			control: None,
+			deferred_sigs: VecDeque::new(),
+			loader: None,
+			attaching: false,
+			gone: false,
+		}
+	}
+
+	fn attached(pid: Pid) -> Self {
+		let mut task = Task::new(pid);
+		task.attaching = true;
+		task
+	}
+
+	// The arena, the trampoline and our end of the control socket went
+	// away with the old address space
+	fn exec(&mut self) {
+		self.arena = Arena { base: None, used: 0 };
+		self.trampoline = None;
+		self.control = None;
+		self.loader = None;
+		self.mem.exec();
+	}
+
+	// Whether the syscall of its seccomp stop was made by the dynamic
+	// loader, e.g. as it maps the libraries of the program before main()
+	pub(crate) fn in_loader(&mut self) -> Result<bool, TaskError> {
+		if self.loader.is_none() {
+			self.loader = Some(loader(self.pid)?);
+		}
+		let ip = self.cache.ip()?;
+		Ok(self.loader.as_ref().unwrap().contains(&ip))
+	}
+
+	// Of the tracee, stopped by its execve()
+	pub(crate) fn setoptions(&self) -> Result<(), TaskError> {
+		ptrace::setoptions(self.pid, options())
+			.map_err(|e| format!("PTRACE_SETOPTIONS {}: {}", self.pid, e))
+	}
+
+	// Sets up the registers to run sysno with args: at a seccomp or
+	// syscall-entry stop in place of the syscall, which only a Skip
+	// script may do, after it by backing up to its syscall instruction.
+	// Returns them as a syscall-entry-stop would show them.
+	pub(crate) fn inject(&mut self, sysno: nc::sysno::Sysno, args: &[Reg]) -> Result<UserRegs, TaskError> {
+		let mut regs = self.cache.regs()?.clone();
+		regs.set_arguments(args)?;
+		if self.at_entry {
+			regs.replace_sysno(sysno);
+		} else {
+			regs.ip_backup()?;
+			regs.set_sysno(sysno)?;
+		}
+		self.cache.set(regs.clone());
+		regs.replace_sysno(sysno);
+		Ok(regs)
+	}
+
+	// Writes back the registers and runs the task on, to the stop how
+	// leads to. stepped() is then passed its next wait status.
+	pub(crate) fn step(&mut self, how: Step) -> Result<(), TaskError> {
+		self.cache.flush()?;
+		match how {
+			Step::Syscall => ptrace::syscall(self.pid, None)
+				.map_err(|e| format!("PTRACE_SYSCALL {}: {}", self.pid, e)),
+			Step::Over => ptrace::step(self.pid, None)
+				.map_err(|e| format!("PTRACE_SINGLESTEP {}: {}", self.pid, e)),
+		}
+	}
+
+	// Whether status is the stop step() ran the task to. If not, it is to
+	// be stepped again. A signal that came first is held back: its
+	// handler would run in the middle of the script.
+	pub(crate) fn stepped(&mut self, how: Step, status: WaitStatus) -> Result<bool, TaskError> {
+		match (how, status) {
+			(Step::Syscall, WaitStatus::PtraceSyscall(_)) => {
+				self.at_entry = !self.at_entry;
+			}
+			(Step::Over, WaitStatus::Stopped(_, Signal::SIGTRAP)) => {
+				self.at_entry = false;
+			}
+			(_, WaitStatus::Stopped(_, signal)) => {
+				self.defer(signal);
+				return Ok(false);
+			}
+			(_, WaitStatus::Exited(..)) | (_, WaitStatus::Signaled(..)) => {
+				return Err(format!("{} is gone, it died in a syscall", self.pid));
+			}
+			_ => return Ok(false),
+		}
+		self.cache.stopped();
+		Ok(true)
+	}
+
+	// Holds back a signal until the task resumes
+	pub(crate) fn defer(&mut self, sig: Signal) {
+		self.deferred_sigs.push_back(sig);
+	}
+
+	// Writes back the registers a script set and lets the task run, with
+	// sig or else the first signal that was held back. The others are
+	// raised again, for the task to stop with each in turn.
+	pub(crate) fn resume(&mut self, sig: Option<Signal>) -> Result<(), TaskError> {
+		self.cache.flush()?;
+		let sig = match sig {
+			Some(sig) => Some(sig),
+			None => self.deferred_sigs.pop_front(),
+		};
+		if !self.deferred_sigs.is_empty() {
+			let tgid = tgid(self.pid)?;
+			for other in self.deferred_sigs.drain(..) {
+				let r = unsafe {
+					libc::syscall(libc::SYS_tgkill, tgid.as_raw(), self.pid.as_raw(), other as libc::c_int)
+				};
+				match Errno::last() {
+					_ if r == 0 => {}
+					Errno::ESRCH => {}
+					e => return Err(format!("tgkill({}, {:?}): {}", self.pid, other, e)),
+				}
+			}
+		}
+		match ptrace::cont(self.pid, sig) {
+			// Killed meanwhile, e.g. by another thread's exit_group():
+			// its death is the next thing waitpid() reports of it
+			Ok(()) | Err(nix::Error::Sys(Errno::ESRCH)) => Ok(()),
+			Err(e) => Err(format!("PTRACE_CONT {}: {}", self.pid, e)),
+		}
+	}
+}
+
+// What is left to the tracer of a wait status, once Tasks saw it
+pub(crate) enum TaskStop {
+	// The status of the current task, to act on
+	Handle(WaitStatus),
+	// Resume the current task, without a signal
+	Resume,
+	// A task is gone, or the status was not of a task
+	Gone,
+}
+
+// Every task of a tracee but the current one, the one whose stop is being
+// handled. Tasks it starts are picked up as they come: the stop of a new
+// task can come before the clone event of its parent.
+pub(crate) struct Tasks {
+	others: HashMap<Pid, Task>,
+	// Started since spawned() was last called
+	spawned: Vec<Pid>,
+}
+
+impl Tasks {
+	pub(crate) fn new() -> Self {
+		Tasks {
+			others: HashMap::new(),
+			spawned: Vec::new(),
+		}
+	}
+
+	// Whether any task is left, curr included
+	pub(crate) fn alive(&self, curr: &Task) -> bool {
+		!curr.gone || !self.others.is_empty()
+	}
+
+	// Every task, curr first
+	pub(crate) fn pids(&self, curr: &Task) -> Vec<Pid> {
+		let mut pids = Vec::with_capacity(1 + self.others.len());
+		if !curr.gone {
+			pids.push(curr.pid);
+		}
+		pids.extend(self.others.keys());
+		pids
+	}
+
+	// The tasks started since the last call
+	pub(crate) fn spawned(&mut self) -> std::vec::Drain<'_, Pid> {
+		self.spawned.drain(..)
+	}
+
+	// Makes pid the current task
+	fn switch(&mut self, curr: &mut Task, pid: Pid) {
+		if curr.pid == pid {
+			return;
+		}
+		let next = self.others.remove(&pid).unwrap_or_else(|| Task::attached(pid));
+		let prev = std::mem::replace(curr, next);
+		if !prev.gone {
+			self.others.insert(prev.pid, prev);
+		}
+	}
+
+	// Makes the task of status the current one, and deals with what
+	// concerns the tasks themselves: attach stops, new tasks, execve()
+	// and exits
+	pub(crate) fn stopped(&mut self, curr: &mut Task, status: WaitStatus) -> Result<TaskStop, TaskError> {
+		let pid = match status.pid() {
+			Some(pid) => pid,
+			None => return Ok(TaskStop::Gone),
+		};
+		self.switch(curr, pid);
+		match status {
+			WaitStatus::Exited(..) | WaitStatus::Signaled(..) => {
+				curr.gone = true;
+				Ok(TaskStop::Gone)
+			}
+			WaitStatus::Stopped(_, Signal::SIGSTOP) if curr.attaching => {
+				curr.attaching = false;
+				Ok(TaskStop::Resume)
+			}
+			WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_CLONE) |
+			WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_FORK) |
+			WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_VFORK) => {
+				let child = ptrace::getevent(pid)
+					.map_err(|e| format!("PTRACE_GETEVENTMSG {}: {}", pid, e))?;
+				let child = Pid::from_raw(child as libc::pid_t);
+				self.others.entry(child).or_insert_with(|| Task::attached(child));
+				self.spawned.push(child);
+				Ok(TaskStop::Resume)
+			}
+			WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_EXEC) => {
+				// A thread that execve()d took over the tid of the thread
+				// group leader, and its own is gone without an exit
+				let former = ptrace::getevent(pid)
+					.map_err(|e| format!("PTRACE_GETEVENTMSG {}: {}", pid, e))?;
+				let former = Pid::from_raw(former as libc::pid_t);
+				if former != pid {
+					self.others.remove(&former);
+				}
+				curr.exec();
+				Ok(TaskStop::Resume)
+			}
+			status => Ok(TaskStop::Handle(status)),
+		}
+	}
+}
@@ -1,232 +1,725 @@
 extern crate nc;
 
-use std::collections::BTreeMap;
 use std::path::Path;
 use std::ffi::CString;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::UnixDatagram;
+use std::panic;
 use nix::unistd::Pid;
-use nix::unistd::execve;
-use nix::sys::wait::{waitpid, WaitPidFlag};
+use nix::unistd::{execve, fork, pipe2, close, ForkResult};
+use nix::fcntl::OFlag;
+use nix::sys::wait::{waitpid, WaitPidFlag, WaitStatus};
 use nix::sys::ptrace;
-use crate::ctrl::{Script, Activation, Val, SkipControl, Instruction};
-use crate::regs::{Word, WORD_SIZE, SWord, Reg, UserRegs, MAX};
+use nix::sys::signal::Signal;
+use crate::ctrl::{Script, Activation, Predicate, Operand, Start, Op, MAX_ARGS};
+use crate::regs::{WORD_SIZE, SWord, Word, Reg, UserRegs, MAX, PAGE_SIZE, NR_SYSCALLS};
+use crate::trampoline;
+use crate::task::{self, Task, Tasks, TaskStop, Step, Control, ARENA_SIZE};
+use crate::seccomp::Filter;
+use crate::pool::{SocketPool, FdMsg};
+use crate::record::{self, Recorder, Replayer};
+use crate::util::Words;
 
 pub struct Tracee {
 	pid: Pid,
+	// Write end of the pipe Tracee::start() reads the seccomp filter from
+	filter_tx: RawFd,
 }
 
 impl Tracee {
-	pub fn new(pid: Pid) -> Self {
+	pub fn new(pid: Pid, filter_tx: RawFd) -> Self {
 		Tracee {
-			pid
+			pid,
+			filter_tx,
 		}
 	}
 
-	pub fn start(prog_path: &Path) {
+	pub fn start(prog_path: &Path, filter_rx: RawFd) {
+		Tracee::start_with_args(prog_path, &[], filter_rx);
+	}
+
+	// argv[0] is the program path, args follow it. The environment is
+	// empty.
+	pub fn start_with_args(prog_path: &Path, args: &[String], filter_rx: RawFd) {
+		Tracee::start_with_env(prog_path, args, &[], filter_rx);
+	}
+
+	// env holds "NAME=value" strings
+	pub fn start_with_env(prog_path: &Path, args: &[String], env: &[String], filter_rx: RawFd) {
 		// Normally this function does not return
+		let path = CString::new(prog_path.to_str().unwrap()).unwrap();
+		let mut argv = vec![path.clone()];
+		argv.extend(args.iter().map(|arg| CString::new(arg.as_str()).unwrap()));
+		let envp: Vec<_> = env.iter().map(|var| CString::new(var.as_str()).unwrap()).collect();
+
 		ptrace::traceme().unwrap();
-		execve(&CString::new(prog_path.to_str().unwrap()).unwrap(), &[], &[]).unwrap();
+		// Only the hooked syscalls will stop the program
+		Filter::receive(filter_rx).unwrap().install().unwrap();
+		execve(&path, &argv, &envp).unwrap();
+	}
+
+	// Forks and starts the program. The calling thread becomes its tracer,
+	// so every later ptrace request for it must come from this thread.
+	pub fn spawn(prog_path: &Path) -> Result<Self, SyncError> {
+		Tracee::spawn_with_args(prog_path, &[])
+	}
+
+	pub fn spawn_with_args(prog_path: &Path, args: &[String]) -> Result<Self, SyncError> {
+		// Close-on-exec: a tracee forked after this one, e.g. by a
+		// TracerGroup, keeps no copy of either end
+		let (filter_rx, filter_tx) = pipe2(OFlag::O_CLOEXEC).map_err(|e| format!("pipe2(): {}", e))?;
+		match fork().map_err(|e| format!("fork(): {}", e))? {
+			ForkResult::Child => {
+				close(filter_tx).ok();
+				// Don't unwind into the caller's copy of the tracer
+				let _ = panic::catch_unwind(|| Tracee::start_with_args(prog_path, args, filter_rx));
+				unsafe { libc::_exit(127) };
+			}
+			ForkResult::Parent { child, .. } => {
+				close(filter_rx).ok();
+				Ok(Tracee::new(child, filter_tx))
+			}
+		}
+	}
+
+	pub fn pid(&self) -> Pid {
+		self.pid
+	}
+
+	pub(crate) fn filter_tx(&self) -> RawFd {
+		self.filter_tx
 	}
 }
 
 type HookError = String;
 type SyncError = String;
 
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum ExecMode {
+	// Each Call backs the tracee up to its syscall instruction, or takes
+	// the place of a Skip script's syscall, and is single-stepped: one
+	// stop per Call
+	Step,
+	// The Calls of a script run from the trampoline, with one resume and
+	// one stop for all of them. Scripts with more than
+	// trampoline::MAX_CALLS Calls are stepped.
+	Batch,
+}
+
 pub struct Tracer<'a, A: Activation + Clone> {
 	tracee: &'a Tracee,
-	hooks: BTreeMap<nc::sysno::Sysno, Script<A>>,
-	mregs: BTreeMap<String, UserRegs>,
-	mval: BTreeMap<String, Reg>,
-	curr_regs: Option<UserRegs>,
+	// Indexed by syscall number
+	hooks: Vec<Option<Script<A>>>,
+	// Script variables, by the slots Script::builder() gave them. Sized
+	// for the largest hooked script when it is hooked.
+	regs: Vec<UserRegs>,
+	vals: Vec<Reg>,
+	// The task whose stop is being handled, and the others
+	task: Task,
+	tasks: Tasks,
+	mode: ExecMode,
+	// The trampoline's table and results, and for each value slot the
+	// batch entry that produces it (0: known to the tracer)
+	table: Vec<Word>,
+	results: Vec<Word>,
+	producer: Vec<usize>,
+	// Where Install takes connections from
+	pool: Option<SocketPool>,
+	// Unhooked syscalls of the log stop too: they are either logged as
+	// they run, or served from the log without running
+	recorder: Option<Recorder>,
+	replayer: Option<Replayer>,
 }
 
 impl<'a, A: Activation + Clone> Tracer<'a, A> {
 	pub fn new(tracee: &'a Tracee) -> Tracer<A> {
 		Tracer {
 			tracee,
-			hooks: BTreeMap::new(),
-			mregs: BTreeMap::new(),
-			mval: BTreeMap::new(),
-			curr_regs: None,
+			hooks: (0..NR_SYSCALLS).map(|_| None).collect(),
+			regs: Vec::new(),
+			vals: Vec::new(),
+			task: Task::new(tracee.pid),
+			tasks: Tasks::new(),
+			mode: ExecMode::Step,
+			table: Vec::with_capacity(trampoline::MAX_CALLS * trampoline::ENTRY_WORDS),
+			results: vec![0; trampoline::MAX_CALLS],
+			producer: Vec::new(),
+			pool: None,
+			recorder: None,
+			replayer: None,
 		}
 	}
 
 	pub fn hook(&mut self, sysno: nc::sysno::Sysno, script: Script<A>) -> Result<(), HookError> {
-		if let Some(_) = self.hooks.get(&sysno) {
-			Err(format!("{} is already hooked", sysno))
-		} else {
-			self.hooks.entry(sysno).or_insert(script);
-			Ok(())
+		if self.is_logged(sysno) {
+			return Err(format!("{} is logged", sysno));
+		}
+		match self.hooks.get_mut(sysno as usize) {
+			None => Err(format!("{} is not a syscall number", sysno)),
+			Some(Some(_)) => Err(format!("{} is already hooked", sysno)),
+			Some(slot) => {
+				if script.nregs > self.regs.len() {
+					let zeroed = UserRegs(unsafe { std::mem::zeroed() });
+					self.regs.resize(script.nregs, zeroed);
+				}
+				if script.nvals > self.vals.len() {
+					self.vals.resize(script.nvals, 0);
+					self.producer.resize(script.nvals, 0);
+				}
+				*slot = Some(script);
+				Ok(())
+			}
+		}
+	}
+
+	pub fn set_mode(&mut self, mode: ExecMode) {
+		self.mode = mode;
+	}
+
+	pub fn set_pool(&mut self, pool: SocketPool) {
+		self.pool = Some(pool);
+	}
+
+	// Logs the syscalls of the recorder, with what they return and write,
+	// until the tracee exits. They can't be hooked as well. Those the
+	// dynamic loader makes are left out, in a replay as well.
+	pub fn record(&mut self, recorder: Recorder) -> Result<(), HookError> {
+		self.check_log(&recorder.syscalls())?;
+		self.recorder = Some(recorder);
+		Ok(())
+	}
+
+	// Serves the syscalls of the log from it, from where the replayer
+	// stands, without running them. The tracee must make them in the
+	// order they were recorded: the tasks of one that starts threads or
+	// children interleave differently from one run to the next.
+	pub fn replay(&mut self, replayer: Replayer) -> Result<(), HookError> {
+		self.check_log(&replayer.syscalls())?;
+		self.replayer = Some(replayer);
+		Ok(())
+	}
+
+	// The recorder back, e.g. to see how much it logged
+	pub fn take_recorder(&mut self) -> Option<Recorder> {
+		self.recorder.take()
+	}
+
+	fn check_log(&self, syscalls: &[nc::sysno::Sysno]) -> Result<(), HookError> {
+		if self.recorder.is_some() || self.replayer.is_some() {
+			return Err("the tracer already records or replays".to_owned());
+		}
+		match syscalls.iter().find(|&&sysno| self.hooks.get(sysno as usize).map_or(false, |h| h.is_some())) {
+			Some(sysno) => Err(format!("{} is hooked", sysno)),
+			None => Ok(()),
 		}
 	}
 
+	fn is_logged(&self, sysno: nc::sysno::Sysno) -> bool {
+		self.recorder.as_ref().map_or(false, |r| r.is_logged(sysno)) ||
+			self.replayer.as_ref().map_or(false, |r| r.is_logged(sysno))
+	}
+
+	fn hooked(&self) -> Vec<(nc::sysno::Sysno, &[Predicate])> {
+		(0..NR_SYSCALLS)
+			.filter_map(|sysno| match &self.hooks[sysno] {
+				Some(script) => Some((sysno as nc::sysno::Sysno, &script.predicates[..])),
+				None if self.is_logged(sysno as nc::sysno::Sysno) => Some((sysno as nc::sysno::Sysno, &[][..])),
+				None => None,
+			})
+			.collect()
+	}
+
+	// Blocks until the tracee and every task it started exit. Any child
+	// of the calling thread is taken for one of them.
 	pub fn sync(&mut self) -> Result<(), SyncError> {
-		// This method is blocking (normally) until the tracee stops
+		self.attach()?;
+		loop {
+			let status = waitpid(None, Some(WaitPidFlag::__WALL | WaitPidFlag::__WNOTHREAD))
+				.map_err(|e| format!("waitpid(): {}", e))?;
+			if !self.handle(status)? {
+				return Ok(());
+			}
+		}
+	}
+
+	// Hands the tracee its seccomp filter and lets it run up to its first
+	// hooked syscall. Its stops are then passed to handle().
+	pub fn attach(&mut self) -> Result<(), SyncError> {
+		// The tracee waits in Tracee::start() for the filter
+		Filter::trace(&self.hooked()).send(self.tracee.filter_tx)?;
 
 		// Initial sync with tracee
-		// TODO: check waitstatus
-		self.init_sync().unwrap();
+		self.init_sync()?;
+		self.task.resume(None)
+	}
 
-		loop {
-			// Each syscall delivery invokes a script
-			let sysno = self.step_syscall()?.get_sysno();
-			match self.hooks.remove(&sysno)
-			{
-				Some(script) => {
-					self.run_script(&script).unwrap();
-					self.hooks.insert(sysno, script);
+	// Tasks the tracee started since the last call: a caller that waits
+	// for stops itself passes theirs to handle() too
+	pub fn spawned(&mut self) -> impl Iterator<Item = Pid> + '_ {
+		self.tasks.spawned()
+	}
+
+	// Acts on one wait status of a task of the tracee and resumes it.
+	// Only hooked syscalls stop, as seccomp stops. Returns false once
+	// every task is gone.
+	pub fn handle(&mut self, status: WaitStatus) -> Result<bool, SyncError> {
+		let status = match self.tasks.stopped(&mut self.task, status)? {
+			TaskStop::Handle(status) => status,
+			TaskStop::Resume => WaitStatus::StillAlive,
+			TaskStop::Gone => return Ok(self.tasks.alive(&self.task)),
+		};
+		let mut sig = None;
+		match status {
+			WaitStatus::PtraceEvent(_, _, libc::PTRACE_EVENT_SECCOMP) => {
+				self.task.cache.stopped();
+				self.task.at_entry = true;
+				if self.replayer.is_some() {
+					// Replay rewrites them: one PTRACE_GETREGS serves both
+					self.task.cache.regs()?;
 				}
-				None => {
-					self.resume().unwrap();
+				let (sysno, _) = self.task.cache.syscall()?;
+				let sysno = sysno as usize;
+				// Taken out of the table for the run, not cloned
+				if let Some(script) = self.hooks[sysno].take() {
+					let res = self.run_script(&script);
+					self.hooks[sysno] = Some(script);
+					res?;
+				} else if self.task.in_loader()? {
+					// Runs for real, unlogged, in a replay too: the
+					// libraries the loader maps need real descriptors
+				} else if self.recorder.is_some() {
+					self.record_syscall()?;
+				} else if self.replayer.is_some() {
+					self.replay_syscall()?;
 				}
 			}
+			WaitStatus::Stopped(_, signal) => {
+				// Signal-delivery-stop: pass the signal on
+				sig = Some(signal);
+			}
+			_ => {}
+		}
+		self.task.resume(sig)?;
+		// While the tracee runs
+		if let Some(pool) = self.pool.as_mut() {
+			pool.fill()?;
+		}
+		Ok(true)
+	}
+
+	fn resolve(&self, operand: &Operand) -> Reg {
+		match operand {
+			Operand::Raw(reg) => *reg,
+			Operand::Slot(slot) => self.vals[*slot],
 		}
 	}
 
-	fn save_regs(&mut self, regs: &UserRegs, name: &str) {
-		self.mregs.entry(name.to_owned()).and_modify(|v| { *v = regs.clone() }).or_insert(regs.clone());
+	fn init_sync(&self) -> Result<(), SyncError> {
+		// Stopped by its execve()
+		waitpid(self.tracee.pid, None).map_err(|e| format!("waitpid({}): {}", self.tracee.pid, e))?;
+		self.task.setoptions()
+	}
+
+	// Runs the task to the stop how leads to, which is waited for alone
+	fn step(&mut self, how: Step) -> Result<(), SyncError> {
+		let pid = self.task.pid;
+		loop {
+			self.task.step(how)?;
+			let status = waitpid(pid, Some(WaitPidFlag::__WALL))
+				.map_err(|e| format!("waitpid({}): {}", pid, e))?;
+			if self.task.stepped(how, status)? {
+				return Ok(());
+			}
+		}
 	}
 
-	fn save_reg(&mut self, val: &Reg, name: &str) {
-		self.mval.entry(name.to_owned()).and_modify(|v| { *v = val.clone() }).or_insert(val.clone());
+	// Lets the syscall of the seccomp stop run, then logs it. One that is
+	// to be restarted is logged once it is restarted and completes.
+	fn record_syscall(&mut self) -> Result<(), SyncError> {
+		let (sysno, args) = self.task.cache.syscall()?;
+		self.step(Step::Syscall)?;
+		let ret = self.task.cache.ret()?;
+		// -ERESTARTSYS to -ERESTART_RESTARTBLOCK, which the tracee never sees
+		if (-516..=-512).contains(&(ret as SWord)) {
+			return Ok(());
+		}
+
+		let out = record::output(sysno, &args, ret);
+		let recorder = self.recorder.as_mut().unwrap();
+		let buf = recorder.append(sysno, &args, ret, out.map_or(0, |(_, len)| len))?;
+		if let Some((addr, _)) = out {
+			self.task.mem.read(addr, buf)?;
+		}
+		Ok(())
 	}
 
-	fn set_regs(&self, regs: &UserRegs) -> Result<(), SyncError> {
-		ptrace::setregs(self.tracee.pid, regs.clone().into()).unwrap();
+	// Skips the syscall of the seccomp stop, and has it return what the
+	// next record of the log does, its output written where this call
+	// of it wants it
+	fn replay_syscall(&mut self) -> Result<(), SyncError> {
+		let mut regs = self.task.cache.regs()?.clone();
+		let (sysno, args) = (regs.get_sysno(), regs.get_arguments());
+		let replayer = self.replayer.as_mut().unwrap();
+		let rec = match replayer.next() {
+			Some(rec) => rec,
+			None => return Err(format!("the log ends before syscall {} of the tracee", sysno)),
+		};
+		if rec.sysno != sysno {
+			return Err(format!("the tracee made syscall {} where record {} is of syscall {}",
+							   sysno, rec.seq, rec.sysno));
+		}
+		// An int, whatever the upper half of the register holds
+		if record::fd_arg(sysno) && rec.args[0] as i32 != args[0] as i32 {
+			return Err(format!("the tracee made syscall {} on fd {} where record {} is on fd {}",
+							   sysno, args[0] as i32, rec.seq, rec.args[0] as i32));
+		}
+		if !rec.out.is_empty() {
+			// Bounded by what the tracee passes now, not by the record
+			match record::buffer(sysno, &args) {
+				Some((addr, room)) if rec.out.len() <= room => self.task.mem.write(addr, rec.out)?,
+				Some((_, room)) => return Err(format!("record {}: {} bytes of output for a buffer of {}",
+													  rec.seq, rec.out.len(), room)),
+				None => return Err(format!("record {}: no buffer for its {} bytes of output",
+										   rec.seq, rec.out.len())),
+			}
+		}
+		regs.set_ret(&rec.ret);
+		regs.no_syscall();
+		self.task.cache.set(regs);
 		Ok(())
 	}
 
-	fn get_regs(&self) -> Result<UserRegs, SyncError> {
-		Ok(UserRegs(ptrace::getregs(self.tracee.pid).unwrap()))
+	// Run one syscall of our own in the tracee, which is stopped at a
+	// syscall, by stepping over it. At its exit, by backing up to the
+	// syscall instruction; at its entry, in place of it, which only a Skip
+	// script may do. Returns the registers at the entry and exit.
+	fn inject(&mut self, sysno: nc::sysno::Sysno, args: &[Reg]) -> Result<(UserRegs, UserRegs), SyncError> {
+		let enter_regs = self.task.inject(sysno, args)?;
+		self.step(Step::Over)?;
+		Ok((enter_regs, self.task.cache.regs()?.clone()))
+	}
+
+	fn inject_syscall(&mut self, sysno: nc::sysno::Sysno, args: &[Reg]) -> Result<Reg, SyncError> {
+		let (_enter_regs, exit_regs) = self.inject(sysno, args)?;
+		Ok(exit_regs.get_ret())
 	}
 
-	fn resolve_val(&self, val: &Val) -> Result<Reg, SyncError> {
-		match val {
-			Val::Raw(reg) => Ok(reg.clone()),
-			Val::Var(name) => {
-				match self.mval.get(&name.to_owned()) {
-					None => Err(format!("{} not found", name)),
-					Some(val) => Ok(val.clone())
+	fn arena_alloc(&mut self, len: usize) -> Result<Reg, SyncError> {
+		let len = walign!(len);
+		if self.task.arena.used + len > ARENA_SIZE {
+			return Err(format!("{} bytes do not fit in the Alloc arena, {} of {} are in use",
+							   len, self.task.arena.used, ARENA_SIZE));
+		}
+
+		let base = match self.task.arena.base {
+			Some(base) => base,
+			None => {
+				let base = self.inject_syscall(nc::SYS_MMAP,
+											   &[0,
+												 ARENA_SIZE as Reg,
+												 (libc::PROT_READ | libc::PROT_WRITE) as Reg,
+												 (libc::MAP_PRIVATE | libc::MAP_ANONYMOUS) as Reg,
+												 MAX, // No fd
+												 0])?;
+				if (base as SWord) < 0 && (base as SWord) >= -4095 {
+					return Err(format!("mmap() failed: {}", -(base as SWord)));
 				}
+				self.task.arena.base = Some(base);
+				base
 			}
-		}
+		};
+
+		let addr = base + self.task.arena.used as Reg;
+		self.task.arena.used += len;
+		Ok(addr)
 	}
 
-	#[allow(deprecated)]
-	fn set_word(&self, addr: *mut Word, data: Word) -> Result<(), SyncError> {
-		unsafe {
-			ptrace::ptrace(ptrace::Request::PTRACE_POKEDATA,
-						   self.tracee.pid,
-						   addr as *mut core::ffi::c_void,
-						   data as *mut core::ffi::c_void,
-			).unwrap();
+	// Makes a socketpair in the tracee and takes our end out of it with
+	// pidfd_getfd(), then closes it in the tracee
+	fn open_control(&mut self) -> Result<Control, SyncError> {
+		let sv = self.arena_alloc(2 * std::mem::size_of::<libc::c_int>())?;
+		let ret = self.inject_syscall(nc::SYS_SOCKETPAIR,
+									  &[libc::AF_UNIX as Reg,
+										(libc::SOCK_DGRAM | libc::SOCK_CLOEXEC) as Reg,
+										0,
+										sv])?;
+		if ret != 0 {
+			return Err(format!("socketpair() failed: {}", -(ret as SWord)));
 		}
-		Ok(())
+		let mut pair = [0 as Word; 1];
+		self.task.mem.read_words(sv, &mut pair)?;
+		let (fd, theirs) = (pair[0] as u32 as Reg, (pair[0] >> 32) as u32 as Reg);
+
+		// A pidfd is of a process: that of the task's thread group, whose
+		// threads share the descriptor table
+		let tgid = task::tgid(self.task.pid)?;
+		let pidfd = unsafe { libc::syscall(libc::SYS_pidfd_open, tgid.as_raw(), 0) };
+		if pidfd < 0 {
+			return Err(format!("pidfd_open({}): {}", tgid, errno::errno()));
+		}
+		let tx = unsafe { libc::syscall(libc::SYS_pidfd_getfd, pidfd, theirs, 0) };
+		let err = errno::errno();
+		unsafe { libc::close(pidfd as RawFd) };
+		if tx < 0 {
+			return Err(format!("pidfd_getfd({}, {}): {}", tgid, theirs, err));
+		}
+		self.inject_syscall(nc::SYS_CLOSE, &[theirs])?;
+
+		Ok(Control {
+			tx: unsafe { UnixDatagram::from_raw_fd(tx as RawFd) },
+			fd,
+		})
 	}
 
-	fn init_sync(&self) -> Result<(), SyncError> {
-		waitpid(self.tracee.pid, Some(WaitPidFlag::empty())).unwrap();
-		ptrace::setoptions(self.tracee.pid, ptrace::Options::PTRACE_O_EXITKILL | ptrace::Options::PTRACE_O_TRACESYSGOOD).unwrap();
-		Ok(())
+	// Installs a connection from the pool in the tracee, with a single
+	// injected recvmsg(). Returns its descriptor there.
+	fn install_socket(&mut self) -> Result<Reg, SyncError> {
+		if self.pool.is_none() {
+			return Err("Install without a socket pool, see Tracer::set_pool()".to_owned());
+		}
+		if self.task.control.is_none() {
+			let control = self.open_control()?;
+			self.task.control = Some(control);
+		}
+		let control = self.task.control.as_ref().unwrap();
+		self.pool.as_mut().unwrap().send(control.tx.as_raw_fd())?;
+		let ctrl_fd = control.fd;
+
+		let addr = self.arena_alloc(Words::<FdMsg>::WORDS * WORD_SIZE)?;
+		self.task.mem.write_words(addr, Words::new(FdMsg::new(addr)).as_words())?;
+		let ret = self.inject_syscall(nc::SYS_RECVMSG, &[ctrl_fd, addr, 0])?;
+		if (ret as SWord) < 0 {
+			return Err(format!("recvmsg() failed: {}", -(ret as SWord)));
+		}
+		let mut cmsg = [0 as Word; FdMsg::CMSG_WORDS];
+		self.task.mem.read_words(FdMsg::cmsg_addr(addr), &mut cmsg)?;
+		FdMsg::received(&cmsg).ok_or_else(|| "recvmsg() got no descriptor".to_owned())
 	}
 
-	fn step_syscall(&mut self) -> Result<UserRegs, SyncError> {
-		ptrace::syscall(self.tracee.pid, None).unwrap();
-		waitpid(self.tracee.pid, Some(WaitPidFlag::empty())).unwrap();
-		let regs = UserRegs(ptrace::getregs(self.tracee.pid).unwrap());
-		self.curr_regs = Some(regs.clone());
-		Ok(regs)
+	// Maps the trampoline: its code page ends up read and execute only
+	fn map_trampoline(&mut self) -> Result<Reg, SyncError> {
+		let base = self.inject_syscall(nc::SYS_MMAP,
+									   &[0,
+										 trampoline::SIZE as Reg,
+										 (libc::PROT_READ | libc::PROT_WRITE) as Reg,
+										 (libc::MAP_PRIVATE | libc::MAP_ANONYMOUS) as Reg,
+										 MAX, // No fd
+										 0])?;
+		if (base as SWord) < 0 && (base as SWord) >= -4095 {
+			return Err(format!("mmap() failed: {}", -(base as SWord)));
+		}
+		self.task.mem.write(base, &trampoline::CODE)?;
+		let ret = self.inject_syscall(nc::SYS_MPROTECT,
+									  &[base,
+										PAGE_SIZE as Reg,
+										(libc::PROT_READ | libc::PROT_EXEC) as Reg])?;
+		if ret != 0 {
+			return Err(format!("mprotect() failed: {}", -(ret as SWord)));
+		}
+		self.task.trampoline = Some(base);
+		Ok(base)
 	}
 
-	fn resume(&self) -> Result<(), SyncError> {
-		ptrace::detach(self.tracee.pid, None).unwrap();
+	// Runs the first count entries of the table from the trampoline, reads
+	// their results and brings the tracee back to where it was stopped
+	fn run_trampoline(&mut self, count: usize) -> Result<(), SyncError> {
+		let base = match self.task.trampoline {
+			Some(base) => base,
+			None => self.map_trampoline()?,
+		};
+		self.task.mem.write_words(trampoline::table(base), &self.table)?;
+
+		let saved = self.task.cache.regs()?.clone();
+		let mut regs = saved.clone();
+		trampoline::enter(&mut regs, base, count);
+		if self.task.at_entry {
+			// The Skip script's syscall never runs
+			regs.no_syscall();
+		}
+		self.task.cache.set(regs);
+		self.task.cache.flush()?;
+
+		let pid = self.task.pid;
+		loop {
+			ptrace::cont(pid, None).map_err(|e| format!("PTRACE_CONT {}: {}", pid, e))?;
+			match waitpid(pid, Some(WaitPidFlag::__WALL)).map_err(|e| format!("waitpid({}): {}", pid, e))? {
+				WaitStatus::Stopped(_, Signal::SIGTRAP) => break,
+				WaitStatus::Stopped(_, signal) => {
+					// Not now, as in Task::stepped(): its handler would
+					// run on the trampoline's registers, and a restarted
+					// syscall would run the batch again. It is delivered
+					// once they are restored.
+					self.task.defer(signal);
+				}
+				WaitStatus::Exited(..) | WaitStatus::Signaled(..) => {
+					return Err("the tracee is gone, it died in the trampoline".to_owned());
+				}
+				// A batched syscall that is itself hooked
+				_ => {}
+			}
+		}
+
+		self.task.mem.read_words(trampoline::results(base, count), &mut self.results[..count])?;
+
+		// Back at the syscall, which returns once Ret has set rax, and
+		// is not restarted
+		let mut regs = saved;
+		regs.no_syscall();
+		self.task.cache.stopped();
+		self.task.cache.set(regs);
+		self.task.at_entry = false;
 		Ok(())
 	}
 
-	fn run_script(&mut self, script: &Script<A>) -> Result<(), SyncError> {
-		// Gather registers and invoke activation
-		// TODO: make it platform-independent
-		let regs = self.get_regs().unwrap();
-		let args = regs.get_arguments();
-		if script.starter.activation.signal(&args[..].iter().map(|u| *u).collect::<Vec<Reg>>().as_slice()).unwrap() {
-			match &script.starter.skip_ctrl {
-				SkipControl::Skip {regs_enter_name} => {
-					self.save_regs(&regs, regs_enter_name);
+	// Runs every Call of the script from the trampoline. Values that only
+	// a batched syscall produces are passed by their entry, the rest are
+	// resolved here. The register slots of a Call get the registers the
+	// syscall was started and returned with.
+	fn run_batch(&mut self, script: &Script<A>) -> Result<(), SyncError> {
+		for producer in self.producer.iter_mut() {
+			*producer = 0;
+		}
+		self.table.clear();
+
+		let mut count = 0;
+		for op in script.ops.iter() {
+			match op {
+				Op::Call {sysno, args, ret, ..} => {
+					self.table.push(*sysno as Word);
+					let mut from = [0 as Word; MAX_ARGS];
+					for idx in 0..MAX_ARGS {
+						let value = match args.get(idx) {
+							Some(Operand::Slot(slot)) if self.producer[*slot] != 0 => {
+								from[idx] = self.producer[*slot] as Word;
+								0
+							}
+							Some(arg) => self.resolve(arg),
+							None => 0,
+						};
+						self.table.push(value);
+					}
+					self.table.extend_from_slice(&from[..]);
+					count += 1;
+					self.producer[*ret] = count;
 				}
-				SkipControl::Keep {regs_enter_name, regs_exit_name, ret_name} => {
-					self.save_regs(&regs, regs_enter_name);
-					let regs = self.step_syscall()?;
-					self.save_regs(&regs, regs_exit_name);
-					self.save_reg(&regs.0.rax, ret_name);
+				Op::Alloc {blob, slot} => {
+					let addr = self.arena_alloc(blob.len() * WORD_SIZE)?;
+					self.task.mem.write_words(addr, blob)?;
+					self.vals[*slot] = addr;
+					self.producer[*slot] = 0;
 				}
-			};
+				Op::Install {slot} => {
+					// Stepped ahead of the batch: nothing in it can be
+					// an input of recvmsg()
+					self.vals[*slot] = self.install_socket()?;
+					self.producer[*slot] = 0;
+				}
+				Op::Ret {..} => {}
+			}
+		}
 
-			// Execute each instruction
-			for instr in script.intrs.iter() {
-				match instr {
-					Instruction::Call {ctrl, sysno, vals} => {
-						let mut base_regs = self.curr_regs.as_ref().unwrap().clone();
-						// Reduce instruction pointer to point to syscall again
-						base_regs.ip_backup().unwrap();
-						base_regs.set_sysno(*sysno).unwrap();
-						base_regs.set_arguments(&vals.iter()
-												.map(|v| self.resolve_val(v).unwrap())
-												.collect::<Vec<Reg>>().as_slice()).unwrap();
-
-						let enter_regs = self.step_syscall()?;
-						let exit_regs = self.step_syscall()?;
-						self.save_regs(&enter_regs, &ctrl.regs_enter_name);
-						self.save_regs(&exit_regs, &ctrl.regs_exit_name);
-						self.save_reg(&exit_regs.get_ret(), &ctrl.ret_name);
-						self.curr_regs = Some(exit_regs);
+		self.run_trampoline(count)?;
+
+		let base_regs = self.task.cache.regs()?.clone();
+		let mut idx = 0;
+		for op in script.ops.iter() {
+			match op {
+				Op::Call {sysno, regs_enter, regs_exit, ret, ..} => {
+					let entry = &self.table[idx * trampoline::ENTRY_WORDS..];
+					let mut args = [0 as Reg; MAX_ARGS];
+					for i in 0..MAX_ARGS {
+						args[i] = match entry[1 + MAX_ARGS + i] {
+							0 => entry[1 + i],
+							from => self.results[from as usize - 1],
+						};
 					}
-					Instruction::Alloc {blob, name} => {
-						if blob.len() == 0 {
-							return Err("Zero-sized blob".to_owned());
-						} else {
-							let mut base_regs = self.curr_regs.as_ref().unwrap().clone();
-							base_regs.ip_backup().unwrap();
-							base_regs.set_sysno(nc::SYS_BRK).unwrap();
-							base_regs.set_argument(1, &MAX).unwrap(); // Set the first argument to -1
-							self.set_regs(&base_regs).unwrap();
-
-							let _enter_regs = self.step_syscall()?;
-							let exit_regs = self.step_syscall()?;
-							let current_brk = exit_regs.get_ret();
-							if (current_brk as SWord) < 0 {
-								return Err("brk() failed".to_owned());
-							}
-							let target_brk = current_brk + blob.len() as Word * WORD_SIZE as Word;
+					let mut enter_regs = base_regs.clone();
+					enter_regs.set_sysno(*sysno)?;
+					enter_regs.set_arguments(&args)?;
+					let mut exit_regs = enter_regs.clone();
+					exit_regs.set_ret(&self.results[idx]);
 
-							base_regs.set_argument(1, &target_brk).unwrap();
-							self.set_regs(&base_regs).unwrap();
-							let _enter_regs = self.step_syscall()?;
-							let exit_regs = self.step_syscall()?;
-							let adjusted_brk = exit_regs.get_ret();
+					self.vals[*ret] = self.results[idx];
+					self.regs[*regs_enter] = enter_regs;
+					self.regs[*regs_exit] = exit_regs;
+					idx += 1;
+				}
+				Op::Ret {val} => {
+					let mut regs = base_regs.clone();
+					regs.set_ret(&self.resolve(val));
+					self.task.cache.set(regs);
+				}
+				Op::Alloc {..} | Op::Install {..} => {}
+			}
+		}
+		Ok(())
+	}
 
-							if adjusted_brk != target_brk {
-								return Err(format!("brk(). Expecting {}, getting {}", target_brk, adjusted_brk));
-							}
+	// Nothing here allocates: variables live in the preallocated slots
+	fn run_script(&mut self, script: &Script<A>) -> Result<(), SyncError> {
+		// Gather registers and invoke activation
+		let (_, args) = self.task.cache.syscall()?;
+		if script.activation.signal(&args).map_err(|e| format!("activation: {:?}", e))? {
+			// Only now are the whole registers worth reading
+			match script.start {
+				Start::Skip {regs_enter} => {
+					self.regs[regs_enter] = self.task.cache.regs()?.clone();
+				}
+				Start::Keep {regs_enter, regs_exit, ret} => {
+					self.regs[regs_enter] = self.task.cache.regs()?.clone();
+					self.step(Step::Syscall)?;
+					let regs = self.task.cache.regs()?.clone();
+					self.vals[ret] = regs.get_ret();
+					self.regs[regs_exit] = regs;
+				}
+			};
 
-							let src = blob.as_slice().as_ptr() as *const Word;
-							let dst = current_brk as *mut Word;
-							for off in 0..blob.len() {
-								let (dstaddr, data) = unsafe {
-									(dst.offset(off as isize), *src.offset(off as isize))
-								};
-								self.set_word(dstaddr, data).unwrap();
-							}
+			let ncalls = script.ops.iter()
+				.filter(|op| if let Op::Call {..} = op { true } else { false })
+				.count();
+			// Without Calls there is nothing to batch
+			if self.mode == ExecMode::Batch && ncalls > 0 && ncalls <= trampoline::MAX_CALLS {
+				self.run_batch(script)?;
+				// The blobs were only for this run
+				self.task.arena.used = 0;
+				return Ok(());
+			}
 
-							self.save_reg(&current_brk, name);
+			// Execute each instruction
+			for op in script.ops.iter() {
+				match op {
+					Op::Call {sysno, args, regs_enter, regs_exit, ret} => {
+						let mut values = [0 as Reg; MAX_ARGS];
+						for (value, arg) in values.iter_mut().zip(args.iter()) {
+							*value = self.resolve(arg);
 						}
+						let (enter_regs, exit_regs) = self.inject(*sysno, &values[..args.len()])?;
+						self.vals[*ret] = exit_regs.get_ret();
+						self.regs[*regs_enter] = enter_regs;
+						self.regs[*regs_exit] = exit_regs;
+					}
+					Op::Alloc {blob, slot} => {
+						let addr = self.arena_alloc(blob.len() * WORD_SIZE)?;
+						self.task.mem.write_words(addr, blob)?;
+						self.vals[*slot] = addr;
 					}
-					Instruction::Ret {val} => {
-						let mut base_regs = self.curr_regs.as_ref().unwrap().clone();
-						base_regs.set_ret(&self.resolve_val(val).unwrap());
-						self.set_regs(&base_regs).unwrap();
-						self.resume()?;
+					Op::Install {slot} => {
+						self.vals[*slot] = self.install_socket()?;
+					}
+					Op::Ret {val} => {
+						let mut base_regs = self.task.cache.regs()?.clone();
+						base_regs.set_ret(&self.resolve(val));
+						if self.task.at_entry {
+							// Nothing ran in place of a Skip script's syscall
+							base_regs.no_syscall();
+						}
+						self.task.cache.set(base_regs);
+						// handle() writes them back as it resumes the tracee
 					}
 				};
 			}
+			// The blobs were only for this run
+			self.task.arena.used = 0;
 			Ok(())
 		} else {
 			Ok(())
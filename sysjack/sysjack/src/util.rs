@@ -1,16 +1,49 @@
-use crate::regs::{Word};
-use byte_slice_cast::*;
+use std::mem;
+use crate::regs::{Word, WORD_SIZE};
 
-use serde::Serialize;
+// #[repr(C)] plain-data types, e.g. libc's sockaddr_un, iovec or msghdr,
+// whose memory is copied into the tracee as it is: their layout is the
+// one the kernel reads.
+//
+// Safety: T must be #[repr(C)] (or transparent over such a type), have no
+// uninitialized padding when built, e.g. from mem::zeroed(), and hold no
+// references, only addresses that mean something in the tracee.
+pub unsafe trait Plain: Copy {}
 
-pub fn struct2words<T: Serialize>(obj: T) -> Vec<Word> {
-	let mut bytes = bincode::serialize(&obj).unwrap();
-	let target_len = walign!(bytes.len());
+unsafe impl Plain for libc::sockaddr_un {}
+unsafe impl Plain for libc::sockaddr_in {}
+unsafe impl Plain for libc::sockaddr_in6 {}
+unsafe impl Plain for libc::iovec {}
+unsafe impl Plain for libc::msghdr {}
+unsafe impl Plain for libc::timespec {}
 
-	// Push zero pads
-	for _ in bytes.len()..target_len {
-		bytes.push(0);
+// A Plain value in word-aligned memory, zero-padded to a whole number of
+// words, which as_words() hands out without a copy
+#[repr(C)]
+pub struct Words<T: Plain> {
+	// Aligns obj to a word
+	align: [Word; 0],
+	obj: T,
+}
+
+impl<T: Plain> Words<T> {
+	// Bytes the kernel reads, e.g. the addrlen of a sockaddr
+	pub const LEN: usize = mem::size_of::<T>();
+	// Words the blob takes, the padding included
+	pub const WORDS: usize = walign!(mem::size_of::<T>()) / WORD_SIZE;
+
+	pub fn new(obj: T) -> Self {
+		// The padding after obj stays zero
+		let mut words: Self = unsafe { mem::zeroed() };
+		words.obj = obj;
+		words
 	}
 
-	bytes.as_slice_of::<Word>().unwrap().into()
+	pub fn as_words(&self) -> &[Word] {
+		unsafe { std::slice::from_raw_parts(self as *const Self as *const Word, Self::WORDS) }
+	}
+}
+
+pub fn struct2words<T: Plain>(obj: T) -> Vec<Word> {
+	Words::new(obj).as_words().to_vec()
 }
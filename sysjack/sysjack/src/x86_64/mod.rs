@@ -2,6 +2,7 @@
 pub mod regs {
 	use nix::unistd::Pid;
 	use nix::sys::ptrace;
+	use nix::errno::Errno;
 
 	#[macro_export]
 	macro_rules! align {
@@ -25,33 +26,143 @@ pub mod regs {
 	pub type Reg = Word;
 	pub const MAX: Reg = std::u64::MAX;
 
+	pub const PAGE_SIZE: usize = 4096;
+
+	// Upper bound of the syscall numbers, for tables indexed by them
+	pub const NR_SYSCALLS: usize = 512;
+
+	// AUDIT_ARCH_X86_64, as seen by seccomp filters
+	pub const AUDIT_ARCH: u32 = 0xc000_003e;
+
+	// Pages read by one process_vm_readv() call
+	const IOV_BATCH: usize = 16;
+
 	pub trait Register {
-		fn resolve_string(&self, pid: Pid) -> String;
+		fn resolve_string<'b>(&self, pid: Pid, reader: &'b mut StringReader) -> Result<&'b [u8], RegError>;
 	}
 
 	impl Register for Reg {
-		#[allow(deprecated)]
-		fn resolve_string(&self, pid: Pid) -> String {
-			let mut bytes: Vec<u8> = Vec::new();
-
-			loop {
-				unsafe {
-					let word = ptrace::ptrace(ptrace::Request::PTRACE_PEEKDATA,
-											  pid,
-											  (*self) as *mut core::ffi::c_void,
-											  0 as *mut core::ffi::c_void,
-					).unwrap();
-					let wordbytes = word.to_le_bytes();
-					if let Some(idx) = wordbytes.iter().position(|x| *x == 0) {
-						bytes.copy_from_slice(&wordbytes[..idx+1]);
+		fn resolve_string<'b>(&self, pid: Pid, reader: &'b mut StringReader) -> Result<&'b [u8], RegError> {
+			reader.read(pid, *self)
+		}
+	}
+
+	fn find_nul(bytes: &[u8]) -> Option<usize> {
+		// glibc's memchr() is vectorized
+		let p = unsafe {
+			libc::memchr(bytes.as_ptr() as *const libc::c_void, 0, bytes.len())
+		};
+		if p.is_null() {
+			None
+		} else {
+			Some(p as usize - bytes.as_ptr() as usize)
+		}
+	}
+
+	// Reads NUL-terminated strings out of the tracee into a buffer that is
+	// reused from one call to the next
+	pub struct StringReader {
+		buf: Vec<u8>,
+		max: usize,
+		// process_vm_readv() was refused, read word by word instead
+		peek_only: bool,
+	}
+
+	impl StringReader {
+		pub fn new(max: usize) -> Self {
+			StringReader {
+				buf: vec![0; max],
+				max,
+				peek_only: false,
+			}
+		}
+
+		// The string at addr without its NUL, cut short at max bytes
+		pub fn read(&mut self, pid: Pid, addr: Reg) -> Result<&[u8], RegError> {
+			let len = if self.peek_only {
+				self.read_peek(pid, addr)?
+			} else {
+				match self.read_vm(pid, addr) {
+					Ok(len) => len,
+					Err(Errno::EPERM) | Err(Errno::ENOSYS) => {
+						self.peek_only = true;
+						self.read_peek(pid, addr)?
+					}
+					Err(e) => {
+						return Err(format!("process_vm_readv at {:#x}: {}", addr, e));
+					}
+				}
+			};
+			Ok(&self.buf[..len])
+		}
+
+		// The remote range is split at page boundaries: a transfer stops at
+		// the first iovec it can't complete, so an unmapped page past the
+		// string only cuts the read short
+		fn read_vm(&mut self, pid: Pid, addr: Reg) -> Result<usize, Errno> {
+			let mut done = 0;
+			while done < self.max {
+				let mut remote = [libc::iovec { iov_base: std::ptr::null_mut(), iov_len: 0 }; IOV_BATCH];
+				let mut n = 0;
+				let mut want = 0;
+				while n < IOV_BATCH && done + want < self.max {
+					let at = addr as usize + done + want;
+					let chunk = std::cmp::min(PAGE_SIZE - (at & (PAGE_SIZE - 1)),
+											  self.max - done - want);
+					remote[n] = libc::iovec { iov_base: at as *mut libc::c_void, iov_len: chunk };
+					n += 1;
+					want += chunk;
+				}
+
+				let local = libc::iovec {
+					iov_base: self.buf[done..].as_mut_ptr() as *mut libc::c_void,
+					iov_len: want,
+				};
+				let got = unsafe {
+					libc::process_vm_readv(pid.as_raw(), &local, 1,
+										   remote.as_ptr(), n as libc::c_ulong, 0)
+				};
+				if got < 0 {
+					let err = Errno::last();
+					if done > 0 && err == Errno::EFAULT {
 						break;
-					} else {
-						bytes.copy_from_slice(&wordbytes[..]);
 					}
+					return Err(err);
+				}
+
+				let got = got as usize;
+				if let Some(idx) = find_nul(&self.buf[done..done + got]) {
+					return Ok(done + idx);
+				}
+				done += got;
+				if got < want {
+					break;
 				}
 			}
+			Ok(done)
+		}
+
+		#[allow(deprecated)]
+		fn read_peek(&mut self, pid: Pid, addr: Reg) -> Result<usize, RegError> {
+			let mut len = 0;
+			while len < self.max {
+				let word = unsafe {
+					ptrace::ptrace(ptrace::Request::PTRACE_PEEKDATA,
+								   pid,
+								   (addr as usize + len) as *mut core::ffi::c_void,
+								   0 as *mut core::ffi::c_void,
+					)
+				}.map_err(|e| format!("PTRACE_PEEKDATA at {:#x}: {}", addr as usize + len, e))?;
 
-			String::from_utf8(bytes).unwrap()
+				let wordbytes = word.to_le_bytes();
+				let n = std::cmp::min(WORD_SIZE, self.max - len);
+				self.buf[len..len + n].copy_from_slice(&wordbytes[..n]);
+				if let Some(idx) = find_nul(&wordbytes[..n]) {
+					return Ok(len + idx);
+				}
+				len += n;
+			}
+			Ok(len)
 		}
 	}
 
@@ -83,10 +194,25 @@ pub mod regs {
 			Ok(())
 		}
 
+		pub fn get_ip(&self) -> Reg {
+			self.0.rip
+		}
+
 		pub fn get_sysno(&self) -> nc::sysno::Sysno {
 			self.0.orig_rax as nc::sysno::Sysno
 		}
 
+		// At a seccomp or syscall-entry stop: the syscall the kernel runs
+		pub fn replace_sysno(&mut self, sysno: nc::sysno::Sysno) {
+			self.0.orig_rax = sysno as u64;
+		}
+
+		// At a seccomp or syscall-entry stop the syscall is skipped and
+		// returns rax. At any other stop, nothing is restarted.
+		pub fn no_syscall(&mut self) {
+			self.0.orig_rax = MAX;
+		}
+
 		pub fn get_ret(&self) -> Reg {
 			self.0.rax
 		}
@@ -95,9 +221,9 @@ pub mod regs {
 			self.0.rax = *ret;
 		}
 
-		pub fn get_arguments(&self) -> Vec<Reg> {
-			vec![self.0.rdi, self.0.rsi, self.0.rdx,
-				 self.0.r10, self.0.r8, self.0.r9]
+		pub fn get_arguments(&self) -> [Reg; 6] {
+			[self.0.rdi, self.0.rsi, self.0.rdx,
+			 self.0.r10, self.0.r8, self.0.r9]
 		}
 
 		pub fn set_argument(&mut self, idx: usize, val: &Reg) -> Result<(), RegError> {
@@ -132,10 +258,8 @@ pub mod regs {
 		}
 
 		pub fn set_arguments(&mut self, values: &[Reg]) -> Result<(), RegError> {
-			if values.len() == 0 {
-				Err("No arguments".to_owned())
-			}
-			else if values.len() > 6 {
+			// None for a syscall that takes none, e.g. getpid()
+			if values.len() > 6 {
 				Err("More arguments than expected".to_owned())
 			} else {
 				for idx in 1..values.len()+1 {
@@ -151,4 +275,254 @@ pub mod regs {
 			self.0
 		}
 	}
+
+	// PTRACE_GET_SYSCALL_INFO, Linux 5.3 and later
+	const PTRACE_GET_SYSCALL_INFO: libc::c_uint = 0x420e;
+	const PTRACE_SYSCALL_INFO_ENTRY: u8 = 1;
+	const PTRACE_SYSCALL_INFO_EXIT: u8 = 2;
+	const PTRACE_SYSCALL_INFO_SECCOMP: u8 = 3;
+
+	// struct ptrace_syscall_info. data holds nr and args[6] at an entry
+	// or seccomp stop, rval and is_error at an exit stop.
+	#[repr(C)]
+	#[derive(Clone, Copy)]
+	struct RawSyscallInfo {
+		op: u8,
+		pad: [u8; 3],
+		arch: u32,
+		ip: u64,
+		sp: u64,
+		data: [u64; 7],
+		ret_data: u32,
+		pad2: u32,
+	}
+
+	// The syscall of a stop, as PTRACE_GET_SYSCALL_INFO has it: 88 bytes
+	// copied out where PTRACE_GETREGS copies out the whole register set
+	#[derive(Clone, Copy)]
+	pub enum SyscallInfo {
+		// ip: the address after the syscall instruction
+		Entry {sysno: nc::sysno::Sysno, args: [Reg; 6], ip: Reg},
+		Exit {ret: Reg},
+		// Not a syscall stop, e.g. a single-step trap
+		None,
+	}
+
+	impl SyscallInfo {
+		// Errors on kernels without PTRACE_GET_SYSCALL_INFO
+		pub fn get(pid: Pid) -> Result<Self, Errno> {
+			let mut raw: RawSyscallInfo = unsafe { std::mem::zeroed() };
+			let res = unsafe {
+				libc::ptrace(PTRACE_GET_SYSCALL_INFO, pid.as_raw(),
+							 std::mem::size_of::<RawSyscallInfo>(),
+							 &mut raw as *mut RawSyscallInfo)
+			};
+			Errno::result(res)?;
+			let mut args = [0; 6];
+			args.copy_from_slice(&raw.data[1..]);
+			Ok(match raw.op {
+				PTRACE_SYSCALL_INFO_ENTRY | PTRACE_SYSCALL_INFO_SECCOMP =>
+					SyscallInfo::Entry {sysno: raw.data[0] as nc::sysno::Sysno, args, ip: raw.ip},
+				PTRACE_SYSCALL_INFO_EXIT => SyscallInfo::Exit {ret: raw.data[0]},
+				_ => SyscallInfo::None,
+			})
+		}
+	}
+
+	// What the tracer knows of the tracee's registers at its current stop.
+	// Each is read once a stop, keyed by the stop's generation, and no
+	// sooner than it is asked for: a syscall's number, arguments and
+	// return value come from PTRACE_GET_SYSCALL_INFO, the whole set from
+	// PTRACE_GETREGS only for those who change it. Changes are written
+	// back once, by flush(), before the tracee is resumed.
+	pub struct RegCache {
+		pid: Pid,
+		generation: u64,
+		info: Option<(u64, SyscallInfo)>,
+		regs: Option<(u64, UserRegs)>,
+		dirty: bool,
+		// PTRACE_GET_SYSCALL_INFO was refused, read the registers instead
+		regs_only: bool,
+	}
+
+	impl RegCache {
+		pub fn new(pid: Pid) -> Self {
+			RegCache {
+				pid,
+				generation: 0,
+				info: None,
+				regs: None,
+				dirty: false,
+				regs_only: false,
+			}
+		}
+
+		// The tracee stopped again: what was read before is stale, and
+		// changes not written back, e.g. by a script that failed, are lost
+		pub fn stopped(&mut self) {
+			self.generation += 1;
+			self.dirty = false;
+		}
+
+		fn cached_regs(&self) -> Option<&UserRegs> {
+			match &self.regs {
+				Some((generation, regs)) if *generation == self.generation => Some(regs),
+				_ => None,
+			}
+		}
+
+		fn info(&mut self) -> SyscallInfo {
+			if let Some((generation, info)) = self.info {
+				if generation == self.generation {
+					return info;
+				}
+			}
+			let info = if self.regs_only {
+				SyscallInfo::None
+			} else {
+				match SyscallInfo::get(self.pid) {
+					Ok(info) => info,
+					Err(_) => {
+						self.regs_only = true;
+						SyscallInfo::None
+					}
+				}
+			};
+			self.info = Some((self.generation, info));
+			info
+		}
+
+		// The registers, read with PTRACE_GETREGS on the first call of
+		// a stop
+		pub fn regs(&mut self) -> Result<&UserRegs, RegError> {
+			if self.cached_regs().is_none() {
+				let regs = ptrace::getregs(self.pid)
+					.map_err(|e| format!("PTRACE_GETREGS: {}", e))?;
+				self.regs = Some((self.generation, UserRegs(regs)));
+			}
+			Ok(self.cached_regs().unwrap())
+		}
+
+		// The syscall and arguments of a seccomp or syscall-entry stop
+		pub fn syscall(&mut self) -> Result<(nc::sysno::Sysno, [Reg; 6]), RegError> {
+			if let Some(regs) = self.cached_regs() {
+				return Ok((regs.get_sysno(), regs.get_arguments()));
+			}
+			match self.info() {
+				SyscallInfo::Entry {sysno, args, ..} => Ok((sysno, args)),
+				_ => {
+					let regs = self.regs()?;
+					Ok((regs.get_sysno(), regs.get_arguments()))
+				}
+			}
+		}
+
+		// Where the syscall of a seccomp or syscall-entry stop was made:
+		// the address after its syscall instruction
+		pub fn ip(&mut self) -> Result<Reg, RegError> {
+			if let Some(regs) = self.cached_regs() {
+				return Ok(regs.get_ip());
+			}
+			match self.info() {
+				SyscallInfo::Entry {ip, ..} => Ok(ip),
+				_ => Ok(self.regs()?.get_ip()),
+			}
+		}
+
+		// The return value at a syscall-exit stop, or after a stepped
+		// syscall
+		pub fn ret(&mut self) -> Result<Reg, RegError> {
+			if let Some(regs) = self.cached_regs() {
+				return Ok(regs.get_ret());
+			}
+			match self.info() {
+				SyscallInfo::Exit {ret} => Ok(ret),
+				_ => Ok(self.regs()?.get_ret()),
+			}
+		}
+
+		// The registers the tracee resumes with, in place of the ones it
+		// stopped with
+		pub fn set(&mut self, regs: UserRegs) {
+			self.regs = Some((self.generation, regs));
+			self.dirty = true;
+		}
+
+		// Writes the registers back if they were set
+		pub fn flush(&mut self) -> Result<(), RegError> {
+			if self.dirty {
+				let regs = self.cached_regs().unwrap().clone();
+				ptrace::setregs(self.pid, regs.into())
+					.map_err(|e| format!("PTRACE_SETREGS: {}", e))?;
+				self.dirty = false;
+			}
+			Ok(())
+		}
+	}
+}
+
+// Runs a table of syscalls in the tracee and traps back with int3: a batch
+// costs one resume and one stop, where stepping costs two stops a syscall
+pub mod trampoline {
+	use crate::regs::{Reg, UserRegs, WORD_SIZE, PAGE_SIZE};
+
+	// One entry per syscall: sysno, args[6], then from[6]. from[i] == 0
+	// passes args[i] as is, from[i] == k the result of entry k - 1.
+	pub const ENTRY_WORDS: usize = 13;
+
+	// The code page, then the data page: the table and a result per entry
+	pub const SIZE: usize = 2 * PAGE_SIZE;
+	pub const MAX_CALLS: usize = PAGE_SIZE / ((ENTRY_WORDS + 1) * WORD_SIZE);
+
+	// rbx: table, rbp: entries, r12: results
+	//
+	//     mov   %r12, %r13
+	//     test  %rbp, %rbp
+	//     jz    9f
+	// 1:  mov   8(%rbx), %rdi          # args[0]
+	//     mov   56(%rbx), %rax         # from[0]
+	//     test  %rax, %rax
+	//     jz    2f
+	//     mov   -8(%r12,%rax,8), %rdi
+	// 2:  ...                          # the same for rsi, rdx, r10, r8, r9
+	//     mov   (%rbx), %rax
+	//     syscall
+	//     mov   %rax, (%r13)
+	//     add   $8, %r13
+	//     add   $104, %rbx
+	//     dec   %rbp
+	//     jnz   1b
+	// 9:  int3
+	pub const CODE: [u8; 147] = [
+		0x4d, 0x89, 0xe5, 0x48, 0x85, 0xed, 0x0f, 0x84, 0x86, 0x00, 0x00, 0x00,
+		0x48, 0x8b, 0x7b, 0x08, 0x48, 0x8b, 0x43, 0x38, 0x48, 0x85, 0xc0, 0x74,
+		0x05, 0x49, 0x8b, 0x7c, 0xc4, 0xf8, 0x48, 0x8b, 0x73, 0x10, 0x48, 0x8b,
+		0x43, 0x40, 0x48, 0x85, 0xc0, 0x74, 0x05, 0x49, 0x8b, 0x74, 0xc4, 0xf8,
+		0x48, 0x8b, 0x53, 0x18, 0x48, 0x8b, 0x43, 0x48, 0x48, 0x85, 0xc0, 0x74,
+		0x05, 0x49, 0x8b, 0x54, 0xc4, 0xf8, 0x4c, 0x8b, 0x53, 0x20, 0x48, 0x8b,
+		0x43, 0x50, 0x48, 0x85, 0xc0, 0x74, 0x05, 0x4d, 0x8b, 0x54, 0xc4, 0xf8,
+		0x4c, 0x8b, 0x43, 0x28, 0x48, 0x8b, 0x43, 0x58, 0x48, 0x85, 0xc0, 0x74,
+		0x05, 0x4d, 0x8b, 0x44, 0xc4, 0xf8, 0x4c, 0x8b, 0x4b, 0x30, 0x48, 0x8b,
+		0x43, 0x60, 0x48, 0x85, 0xc0, 0x74, 0x05, 0x4d, 0x8b, 0x4c, 0xc4, 0xf8,
+		0x48, 0x8b, 0x03, 0x0f, 0x05, 0x49, 0x89, 0x45, 0x00, 0x49, 0x83, 0xc5,
+		0x08, 0x48, 0x83, 0xc3, 0x68, 0x48, 0xff, 0xcd, 0x0f, 0x85, 0x7a, 0xff,
+		0xff, 0xff, 0xcc,
+	];
+
+	pub fn table(base: Reg) -> Reg {
+		base + PAGE_SIZE as Reg
+	}
+
+	pub fn results(base: Reg, count: usize) -> Reg {
+		table(base) + (count * ENTRY_WORDS * WORD_SIZE) as Reg
+	}
+
+	// Points the tracee at the trampoline mapped at base, which will run
+	// the first count entries of its table
+	pub fn enter(regs: &mut UserRegs, base: Reg, count: usize) {
+		regs.0.rip = base;
+		regs.0.rbx = table(base);
+		regs.0.rbp = count as Reg;
+		regs.0.r12 = results(base, count);
+	}
 }
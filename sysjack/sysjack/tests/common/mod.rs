@@ -0,0 +1,65 @@
+// What the integration tests share: their tracee, tests/tracee.c, built
+// with cc, and the pipe it reports on.
+
+use nix::unistd::{pipe, close};
+use std::fs::File;
+use std::io::Read;
+use std::os::unix::io::{FromRawFd, RawFd};
+use std::path::{Path, PathBuf};
+use std::process::Command;
+use std::sync::{Mutex, MutexGuard, Once};
+
+static BUILD: Once = Once::new();
+static TRACING: Mutex<()> = Mutex::new(());
+
+pub fn tracee() -> PathBuf {
+	let out = std::env::temp_dir().join("sysjack-test-tracee");
+	BUILD.call_once(|| {
+		let src = Path::new(env!("CARGO_MANIFEST_DIR")).join("tests/tracee.c");
+		let status = Command::new("cc")
+			.args(&["-O2", "-pthread", "-o"])
+			.arg(&out)
+			.arg(&src)
+			.status()
+			.expect("cc");
+		assert!(status.success(), "building {:?}", src);
+	});
+	out
+}
+
+// Held by a test while it traces. Tracees are forked from the test
+// threads: one at a time, so that none inherits the pipe ends of another
+// test, and none is forked while another thread holds a lock the child
+// needs before its execve().
+pub fn serial() -> MutexGuard<'static, ()> {
+	TRACING.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+// A pipe the tracee writes its report to
+pub struct Report {
+	rx: File,
+	tx: RawFd,
+}
+
+impl Report {
+	pub fn new() -> Self {
+		let (rx, tx) = pipe().unwrap();
+		Report {
+			rx: unsafe { File::from_raw_fd(rx) },
+			tx,
+		}
+	}
+
+	// The tracee's OUT argument
+	pub fn arg(&self) -> String {
+		self.tx.to_string()
+	}
+
+	// What the tracee wrote, once it is gone
+	pub fn read(mut self) -> String {
+		close(self.tx).unwrap();
+		let mut report = String::new();
+		self.rx.read_to_string(&mut report).unwrap();
+		report
+	}
+}
@@ -0,0 +1,123 @@
+// Scripts run over tests/tracee.c, in both execution modes
+
+mod common;
+
+use sysjack::common::SockaddrUn;
+use sysjack::ctrl::{Val, SkipControl, ScriptStarter, Predicate,
+					FailControl, CallControl, Script};
+use sysjack::trace::{Tracee, Tracer, ExecMode};
+use sysjack::regs::{Register, Reg, StringReader};
+use sysjack::util::{struct2words, Words};
+
+use nc::{SYS_OPENAT, SYS_SOCKET, SYS_CONNECT, SYS_GETPPID, SYS_GETPID,
+		 AF_UNIX, SOCK_STREAM};
+use std::cell::RefCell;
+use std::convert::TryInto;
+use std::path::Path;
+use common::Report;
+
+static WRITER_OUTPUT: &str = "/tmp/writer_output";
+static SOCKET_PATH: &str = "/tmp/portalsock";
+
+// The openat() of WRITER_OUTPUT becomes a socket() and a connect() to
+// SOCKET_PATH, as main.rs has it, in every task of the tracee. The file
+// is never created, whether or not anything listens on SOCKET_PATH: the
+// tracee gets the socket either way.
+fn writer_output_is_a_socket(mode: ExecMode) {
+	let _serial = common::serial();
+	std::fs::remove_file(WRITER_OUTPUT).ok();
+	let report = Report::new();
+	let args = [report.arg(), "open".to_owned(), WRITER_OUTPUT.to_owned()];
+	let tracee = Tracee::spawn_with_args(&common::tracee(), &args).unwrap();
+
+	let pid = tracee.pid();
+	let path_reader = RefCell::new(StringReader::new(libc::PATH_MAX as usize));
+	let activation = |_dirfd: Reg, pathname: Reg, _flags: Reg, _mode: Reg| {
+		pathname.resolve_string(pid, &mut path_reader.borrow_mut())
+			.map_or(false, |path| path == WRITER_OUTPUT.as_bytes())
+	};
+	let activation = &activation as &dyn Fn(Reg, Reg, Reg, Reg) -> bool;
+	let starter = ScriptStarter::new(activation, SkipControl::Skip {
+		regs_enter_name: "openat_regs_enter".to_owned()
+	});
+	let blob = struct2words(SockaddrUn::new(AF_UNIX.try_into().unwrap(), SOCKET_PATH));
+	let bloblen = Words::<SockaddrUn>::LEN;
+	let mut builder = Script::builder();
+	builder.new(starter, FailControl::Default)
+		.when(Predicate::int_eq(0, nc::AT_FDCWD as i32))
+		.call(CallControl::new("socket_regs_enter".to_owned(),
+							   "socket_regs_exit".to_owned(),
+							   "socket_ret".to_owned()),
+			  SYS_SOCKET,
+			  vec![Val::Raw(AF_UNIX as Reg),
+				   Val::Raw(SOCK_STREAM as Reg),
+				   Val::Raw(0)])
+		.alloc(blob, "serveraddr".to_owned())
+		.call(CallControl::new("connect_regs_enter".to_owned(),
+							   "connect_exit".to_owned(),
+							   "connect_ret".to_owned()),
+			  SYS_CONNECT,
+			  vec![Val::Var("socket_ret".to_owned()),
+				   Val::Var("serveraddr".to_owned()),
+				   Val::Raw(bloblen as Reg)])
+		.ret(Val::Var("socket_ret".to_owned()));
+
+	let mut tracer = Tracer::new(&tracee);
+	tracer.set_mode(mode);
+	tracer.hook(SYS_OPENAT, builder.build().unwrap()).unwrap();
+	tracer.sync().unwrap();
+
+	// The main thread, the other thread and the child got a descriptor
+	assert_eq!(report.read(), "1 1 1\n");
+	assert!(!Path::new(WRITER_OUTPUT).exists(), "{} was created", WRITER_OUTPUT);
+}
+
+// getppid() answered with getpid(), a Call without arguments
+fn getppid_is_getpid(mode: ExecMode) {
+	let _serial = common::serial();
+	let report = Report::new();
+	let tracee = Tracee::spawn_with_args(&common::tracee(), &[report.arg(), "pids".to_owned()]).unwrap();
+
+	let activation = |_: Reg| true;
+	let activation = &activation as &dyn Fn(Reg) -> bool;
+	let starter = ScriptStarter::new(activation, SkipControl::Skip {
+		regs_enter_name: "getppid_regs_enter".to_owned()
+	});
+	let mut builder = Script::builder();
+	builder.new(starter, FailControl::Default)
+		.call(CallControl::new("getpid_regs_enter".to_owned(),
+							   "getpid_regs_exit".to_owned(),
+							   "getpid_ret".to_owned()),
+			  SYS_GETPID,
+			  vec![])
+		.ret(Val::Var("getpid_ret".to_owned()));
+
+	let mut tracer = Tracer::new(&tracee);
+	tracer.set_mode(mode);
+	tracer.hook(SYS_GETPPID, builder.build().unwrap()).unwrap();
+	tracer.sync().unwrap();
+
+	let report = report.read();
+	let pids: Vec<&str> = report.split_whitespace().collect();
+	assert_eq!(pids, [tracee.pid().to_string(), tracee.pid().to_string()]);
+}
+
+#[test]
+fn call_without_arguments_step() {
+	getppid_is_getpid(ExecMode::Step);
+}
+
+#[test]
+fn call_without_arguments_batch() {
+	getppid_is_getpid(ExecMode::Batch);
+}
+
+#[test]
+fn openat_hook_step() {
+	writer_output_is_a_socket(ExecMode::Step);
+}
+
+#[test]
+fn openat_hook_batch() {
+	writer_output_is_a_socket(ExecMode::Batch);
+}
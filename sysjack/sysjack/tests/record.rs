@@ -0,0 +1,89 @@
+// A record of tests/tracee.c replayed, the file it read gone by then
+
+mod common;
+
+use sysjack::trace::{Tracee, Tracer};
+use sysjack::record::{Recorder, Replayer, IO_SYSCALLS};
+use sysjack::regs::Reg;
+
+use nc::{SYS_WRITE, sysno::Sysno};
+use nix::sys::signal::{kill, Signal};
+use nix::sys::wait::waitpid;
+use std::path::PathBuf;
+use common::Report;
+
+fn temp_path(name: &str) -> PathBuf {
+	std::env::temp_dir().join(format!("sysjack-test-{}-{}", name, std::process::id()))
+}
+
+// The tracee, which is linked dynamically, runs under a Tracer set up by
+// setup and reports the checksum of PATH, read chunk bytes at a time. If
+// the Tracer fails, the tracee is killed.
+fn sum(path: &PathBuf, chunk: usize, setup: impl FnOnce(&mut Tracer<&dyn Fn(Reg) -> bool>))
+	   -> Result<String, String> {
+	let report = Report::new();
+	let args = [report.arg(), "sum".to_owned(), path.to_str().unwrap().to_owned(), chunk.to_string()];
+	let tracee = Tracee::spawn_with_args(&common::tracee(), &args).unwrap();
+	let mut tracer = Tracer::new(&tracee);
+	setup(&mut tracer);
+	if let Err(e) = tracer.sync() {
+		kill(tracee.pid(), Signal::SIGKILL).ok();
+		waitpid(tracee.pid(), None).ok();
+		return Err(e);
+	}
+	Ok(report.read())
+}
+
+fn remove_log(log: PathBuf) {
+	std::fs::remove_file(&log).ok();
+	let mut idx = log.into_os_string();
+	idx.push(".idx");
+	std::fs::remove_file(idx).ok();
+}
+
+// Everything but the report, which is written for real in both runs
+fn syscalls() -> Vec<Sysno> {
+	IO_SYSCALLS.iter().cloned().filter(|&sysno| sysno != SYS_WRITE).collect()
+}
+
+#[test]
+fn record_then_replay() {
+	let _serial = common::serial();
+	let data = temp_path("data");
+	let log = temp_path("log");
+	std::fs::write(&data, (0..10000u32).map(|i| (i * 7) as u8).collect::<Vec<u8>>()).unwrap();
+
+	let recorded = sum(&data, 4096, |tracer| {
+		tracer.record(Recorder::create(&log, &syscalls()).unwrap()).unwrap();
+	}).unwrap();
+	std::fs::remove_file(&data).unwrap();
+	let replayed = sum(&data, 4096, |tracer| {
+		tracer.replay(Replayer::open(&log).unwrap()).unwrap();
+	}).unwrap();
+
+	remove_log(log);
+	assert_eq!(recorded.len(), 17, "recorded: {:?}", recorded);
+	assert_eq!(replayed, recorded);
+}
+
+// A replay that reads into a smaller buffer than the record did fails
+// rather than write past it
+#[test]
+fn replay_into_smaller_buffer() {
+	let _serial = common::serial();
+	let data = temp_path("small-data");
+	let log = temp_path("small-log");
+	std::fs::write(&data, vec![7u8; 10000]).unwrap();
+
+	sum(&data, 4096, |tracer| {
+		tracer.record(Recorder::create(&log, &syscalls()).unwrap()).unwrap();
+	}).unwrap();
+	std::fs::remove_file(&data).unwrap();
+	let replayed = sum(&data, 1024, |tracer| {
+		tracer.replay(Replayer::open(&log).unwrap()).unwrap();
+	});
+
+	remove_log(log);
+	let e = replayed.expect_err("replayed 4096 bytes into 1024");
+	assert!(e.contains("4096 bytes of output for a buffer of 1024"), "{}", e);
+}
@@ -0,0 +1,111 @@
+/*
+ * Tracee of the integration tests:
+ *
+ *   tracee OUT pids         writes getppid() and getpid() to OUT
+ *   tracee OUT open PATH    creates PATH from the main thread, from
+ *                           another thread and from a forked child, and
+ *                           writes whether each got a descriptor to OUT
+ *   tracee OUT sum PATH [N] writes a checksum of the size and bytes of
+ *                           PATH, read N bytes at a time (at most and by
+ *                           default 4096), and of 16 bytes of getrandom(),
+ *                           to OUT
+ *
+ * OUT is the number of a descriptor it inherits, the write end of a pipe
+ * the test reads its report from.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static const char *open_path;
+
+static int open_ok(void)
+{
+	int fd = open(open_path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return 1;
+}
+
+static void *open_thread(void *ok)
+{
+	*(int *) ok = open_ok();
+	return NULL;
+}
+
+/* FNV-1a */
+static uint64_t sum(uint64_t h, const void *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ ((const unsigned char *) buf)[i]) * 0x100000001b3ull;
+	return h;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "tracee OUT pids|open PATH|sum PATH [N]\n");
+		return 1;
+	}
+	int out = atoi(argv[1]);
+	const char *what = argv[2];
+
+	if (strcmp(what, "pids") == 0) {
+		dprintf(out, "%d %d\n", getppid(), getpid());
+		return 0;
+	}
+	if (strcmp(what, "open") == 0 && argc == 4) {
+		open_path = argv[3];
+		int main_ok = open_ok();
+
+		pthread_t thread;
+		int thread_ok = 0;
+		if (pthread_create(&thread, NULL, open_thread, &thread_ok) == 0)
+			pthread_join(thread, NULL);
+
+		int child_ok = 0, status;
+		pid_t child = fork();
+		if (child == 0)
+			_exit(open_ok());
+		if (child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status))
+			child_ok = WEXITSTATUS(status);
+
+		dprintf(out, "%d %d %d\n", main_ok, thread_ok, child_ok);
+		return 0;
+	}
+	if (strcmp(what, "sum") == 0 && (argc == 4 || argc == 5)) {
+		uint64_t h = 0xcbf29ce484222325ull;
+		char buf[4096];
+		size_t chunk = argc == 5 ? strtoul(argv[4], NULL, 10) : sizeof(buf);
+		if (chunk == 0 || chunk > sizeof(buf))
+			chunk = sizeof(buf);
+		int fd = open(argv[3], O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			perror(argv[3]);
+			return 1;
+		}
+		h = sum(h, &st.st_size, sizeof(st.st_size));
+		ssize_t n;
+		while ((n = read(fd, buf, chunk)) > 0)
+			h = sum(h, buf, n);
+		close(fd);
+		if (getrandom(buf, 16, 0) != 16) {
+			perror("getrandom");
+			return 1;
+		}
+		h = sum(h, buf, 16);
+		dprintf(out, "%016llx\n", (unsigned long long) h);
+		return 0;
+	}
+	fprintf(stderr, "tracee: unknown %s\n", what);
+	return 1;
+}